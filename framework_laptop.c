@@ -10,17 +10,36 @@
  */
 
 #include <linux/acpi.h>
+#include <linux/debugfs.h>
+#include <linux/hrtimer.h>
 #include <linux/hwmon.h>
 #include <linux/hwmon-sysfs.h>
 #include <linux/init.h>
 #include <linux/input.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
 #include <linux/leds.h>
+#include <linux/kref.h>
+#include <linux/led-class-multicolor.h>
+#include <linux/math64.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/pci_ids.h>
 #include <linux/power_supply.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/seqlock.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
 #include <linux/sysfs.h>
+#include <linux/thermal.h>
 #include <linux/types.h>
+#include <linux/units.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 #include <linux/dmi.h>
 #include <linux/platform_device.h>
 #include <linux/platform_data/cros_ec_proto.h>
@@ -29,17 +48,12 @@
 
 #include <acpi/battery.h>
 
+#define CREATE_TRACE_POINTS
+#include "framework_laptop_trace.h"
+
 #define DRV_NAME "framework_laptop"
 #define FRAMEWORK_LAPTOP_EC_DEVICE_NAME "cros-ec-dev"
 
-static struct platform_device *fwdevice;
-static struct device *ec_device;
-struct framework_data {
-	struct platform_device *pdev;
-	struct led_classdev kb_led;
-	struct device *hwmon_dev;
-};
-
 #define EC_CMD_CHARGE_LIMIT_CONTROL 0x3E03
 
 enum ec_chg_limit_control_modes {
@@ -72,578 +86,4283 @@ struct ec_response_privacy_switches_check {
 	uint8_t camera;
 } __ec_align1;
 
-static int charge_limit_control(enum ec_chg_limit_control_modes modes, uint8_t max_percentage) {
-	struct {
-		struct cros_ec_command msg;
-		union {
-			struct ec_params_ec_chg_limit_control params;
-			struct ec_response_chg_limit_control resp;
-		};
-	} __packed buf;
-	struct ec_params_ec_chg_limit_control *params = &buf.params;
-	struct ec_response_chg_limit_control *resp = &buf.resp;
-	struct cros_ec_command *msg = &buf.msg;
-	struct cros_ec_device *ec;
-	int ret;
+// Last known privacy switch state, reported to userspace when it changes
+struct framework_privacy {
+	struct mutex lock;
+	// Last state read from the EC, once valid is set
+	bool valid;
+	struct ec_response_privacy_switches_check state;
+	struct input_dev *input;
+	struct work_struct work;
+	unsigned long checked;
+};
 
-	if (!ec_device)
-		return -ENODEV;
+#define FW_POLL_INTERVAL_MIN 10
+#define FW_POLL_INTERVAL_MAX 60000
+
+static unsigned int poll_interval = 1000;
+module_param(poll_interval, uint, 0444);
+MODULE_PARM_DESC(poll_interval, "Initial interval in milliseconds between EC memory map reads");
+
+static unsigned int poll_interval_max = 8000;
+module_param(poll_interval_max, uint, 0644);
+MODULE_PARM_DESC(poll_interval_max, "Longest interval in milliseconds between EC memory map reads while nothing changes and nobody reads");
+
+// The poller backs off while fans move less than this many RPM, temperatures
+// less than this many degrees, and nobody has read for this many milliseconds
+#define FW_POLL_RPM_DELTA 100
+#define FW_POLL_TEMP_DELTA 2
+#define FW_POLL_READER_TIMEOUT 10000
+
+static unsigned int fan_write_interval = 100;
+module_param(fan_write_interval, uint, 0644);
+MODULE_PARM_DESC(fan_write_interval, "Minimum time in milliseconds between two control writes to the same fan");
+
+#define FW_CACHE_ENTRIES 8
+#define FW_CACHE_DATA_SIZE 16
+
+// How often (in milliseconds) the poller rechecks the privacy switches, in
+// case the EC doesn't send an event when they change
+#define FW_PRIVACY_RECHECK_INTERVAL 5000
+
+// How long (in milliseconds) a cached host command response stays valid
+#define FW_CACHE_TTL_CHARGE_LIMIT 5000
+#define FW_CACHE_TTL_KB_LED 1000
+#define FW_CACHE_TTL_FAN_TARGET 1000
+#define FW_CACHE_TTL_PRIVACY 1000
+
+// Keyboard backlight patterns are stepped by the driver, since the EC can only
+// hold one brightness. Steps are sent at most every FW_KB_PATTERN_TICK
+// milliseconds.
+#define FW_KB_PATTERN_MAX 16
+#define FW_KB_PATTERN_TICK 50
+#define FW_KB_BLINK_DEFAULT 500
+
+// Things the EC tells us about, reported through ec_events
+enum framework_event {
+	FW_EVENT_AC,
+	FW_EVENT_BATTERY,
+	FW_EVENT_BATTERY_CRITICAL,
+	FW_EVENT_CHARGE_STOPPED,
+	FW_EVENT_THERMAL,
+	FW_EVENT_THROTTLE_START,
+	FW_EVENT_THROTTLE_STOP,
+	FW_EVENT_COUNT,
+};
 
-	ec = dev_get_drvdata(ec_device);
+#ifndef FRAMEWORK_LAPTOP_KUNIT
+static struct platform_device *fwdevice;
+#endif
+// All of the driver's background work runs here. It's unbound and visible
+// in /sys/devices/virtual/workqueue, so its cpumask can be restricted to
+// housekeeping CPUs.
+static struct workqueue_struct *fw_wq;
+static struct device *ec_device;
 
-	memset(&buf, 0, sizeof(buf));
+// The EC's memory map from EC_MEMMAP_TEMP_SENSOR up to the end of the fans,
+// which the poller reads in a single transaction
+struct framework_memmap_thermal {
+	u8 temps[EC_TEMP_SENSOR_ENTRIES];
+	u16 fans[EC_FAN_SPEED_ENTRIES];
+} __packed;
+
+static_assert(offsetof(struct framework_memmap_thermal, fans) ==
+	      EC_MEMMAP_FAN - EC_MEMMAP_TEMP_SENSOR);
+
+// The EC's battery block, from EC_MEMMAP_BATT_VOLT up to EC_MEMMAP_BATT_FLAG
+struct framework_memmap_battery {
+	u32 volt;	/* mV */
+	u32 rate;	/* mA */
+	u32 cap;	/* mAh */
+	u8 flag;	/* EC_BATT_FLAG_* */
+} __packed;
+
+static_assert(offsetof(struct framework_memmap_battery, rate) ==
+	      EC_MEMMAP_BATT_RATE - EC_MEMMAP_BATT_VOLT);
+static_assert(offsetof(struct framework_memmap_battery, cap) ==
+	      EC_MEMMAP_BATT_CAP - EC_MEMMAP_BATT_VOLT);
+static_assert(offsetof(struct framework_memmap_battery, flag) ==
+	      EC_MEMMAP_BATT_FLAG - EC_MEMMAP_BATT_VOLT);
+
+// Last values read from the EC's memory map by the poller
+struct framework_snapshot {
+	u64 timestamp;	/* ktime_get_ns() at the time of the read */
+	int status;
+	u8 temps[EC_TEMP_SENSOR_ENTRIES];
+	u16 fans[EC_FAN_SPEED_ENTRIES];
 
-	msg->version = 0;
-	msg->command = EC_CMD_CHARGE_LIMIT_CONTROL;
-	msg->outsize = sizeof(*params);
-	msg->insize = sizeof(*resp);
+	int battery_status;
+	struct framework_memmap_battery battery;
 
-	params->modes = modes;
-	params->max_percentage = max_percentage;
+	// Only taken if the EC has EC_CMD_POWER_INFO
+	int power_status;
+	struct ec_response_power_info power;
+};
 
-	ret = cros_ec_cmd_xfer_status(ec, msg);
-	if (ret < 0) {
-		return -EIO;
-	}
+enum framework_fan_mode {
+	FW_FAN_MODE_AUTO,
+	FW_FAN_MODE_DUTY,
+	FW_FAN_MODE_RPM,
+};
 
-	return resp->max_percentage;
-}
+struct framework_fan_request {
+	enum framework_fan_mode mode;
+	u32 value;
+	// The attribute or work that asked, for the trace events
+	const char *origin;
+};
 
-// Get the last set keyboard LED brightness
-static enum led_brightness kb_led_get(struct led_classdev *led)
-{
-	struct {
-		struct cros_ec_command msg;
-		union {
-			struct ec_params_pwm_get_duty p;
-			struct ec_response_pwm_get_duty resp;
-		};
-	} __packed buf;
+// Origins of the commands sent for each fan's attributes
+static const char * const fw_origin_pwm[EC_FAN_SPEED_ENTRIES] = {
+	"pwm1", "pwm2", "pwm3", "pwm4",
+};
+static const char * const fw_origin_pwm_enable[EC_FAN_SPEED_ENTRIES] = {
+	"pwm1_enable", "pwm2_enable", "pwm3_enable", "pwm4_enable",
+};
+static const char * const fw_origin_fan_target[EC_FAN_SPEED_ENTRIES] = {
+	"fan1_target", "fan2_target", "fan3_target", "fan4_target",
+};
 
-	struct ec_params_pwm_get_duty *p = &buf.p;
-	struct ec_response_pwm_get_duty *resp = &buf.resp;
-	struct cros_ec_command *msg = &buf.msg;
-	struct cros_ec_device *ec;
-	int ret;
-	if (!ec_device)
-		goto out;
+// Write-behind state for one fan. Requests are coalesced so that only the
+// newest one is sent, at most once every fan_write_interval milliseconds.
+struct framework_fan {
+	struct framework_data *data;
+	u8 idx;
+	spinlock_t lock;
+	struct delayed_work work;
+	bool has_pending;
+	struct framework_fan_request pending;
+	// The request that was last sent (or is being sent) to the EC
+	bool has_sent;
+	struct framework_fan_request sent;
+	unsigned long sent_at;
+	int error;
+	// Last thing asked of the fan, whether or not it has been sent yet
+	enum framework_fan_mode mode;
+	u32 duty;
+	u32 rpm;
+	bool has_duty;
+	struct thermal_cooling_device *cdev;
+
+	// Speed history, kept by the poller. average is in mRPM, and decays
+	// with a time constant of average_interval milliseconds.
+	bool has_history;
+	u16 lowest;
+	u16 highest;
+	s64 average;
+	u64 average_at;
+	unsigned int average_interval;
+};
 
-	ec = dev_get_drvdata(ec_device);
+// Telemetry ring layout, shared with userspace through mmap. The header takes
+// the first page and the records follow.
+#define FW_RING_MAGIC 0x544c5746 // "FWLT"
+#define FW_RING_VERSION 1
+#define FW_RING_RECORDS 4096
+
+struct framework_ring_header {
+	__u32 magic;
+	__u32 version;
+	__u32 header_size;
+	__u32 record_size;
+	__u32 nr_records;
+	__u32 reserved;
+	// Number of records written so far; record n is at n % nr_records
+	__u64 head;
+};
 
-	memset(&buf, 0, sizeof(buf));
+#define FW_RING_THERMAL_VALID BIT(0)
+#define FW_RING_BATTERY_VALID BIT(1)
+
+// The raw EC memmap words from one snapshot
+struct framework_ring_record {
+	__u64 timestamp_ns;
+	__u8 temps[EC_TEMP_SENSOR_ENTRIES];
+	__u16 fans[EC_FAN_SPEED_ENTRIES];
+	__u32 batt_volt;
+	__u32 batt_rate;
+	__u32 batt_cap;
+	__u8 batt_flag;
+	__u8 flags;
+	__u8 reserved[10];
+};
 
-	p->pwm_type = EC_PWM_TYPE_KB_LIGHT;
-	
-	msg->version = 0;
-	msg->command = EC_CMD_PWM_GET_DUTY;
-	msg->insize = sizeof(*resp);
-	msg->outsize = sizeof(*p);
+static_assert(sizeof(struct framework_ring_record) == 56);
+
+// Lives until the driver and every open file are done with it; mappings
+// hold a reference to their file
+struct framework_ring {
+	struct kref ref;
+	// Open files; the poller runs at full rate while there are any
+	atomic_t users;
+	void *base;
+	struct framework_ring_header *header;
+	struct framework_ring_record *records;
+};
 
-	ret = cros_ec_cmd_xfer_status(ec, msg);
-	if (ret < 0) {
-		goto out;
-	}
+#define FW_AVERAGE_INTERVAL_DEFAULT 60000
+#define FW_AVERAGE_INTERVAL_MAX 3600000
 
-	return resp->duty * 100 / EC_PWM_MAX_DUTY;
+#define FW_CURVE_POINTS 4
+#define FW_CURVE_TEMP_MAX 150000
 
-out:
-	return 0;
-}
+struct framework_curve_point {
+	long temp;
+	u8 pwm;
+};
 
-// Set the keyboard LED brightness
-static int kb_led_set(struct led_classdev *led, enum led_brightness value)
-{
-	struct {
-		struct cros_ec_command msg;
-		union {
-			struct ec_params_pwm_set_keyboard_backlight params;
-		};
-	} __packed buf;
+// In-kernel temperature to duty curve for one fan, evaluated by the poller
+struct framework_fan_curve {
+	bool enabled;
+	struct framework_curve_point points[FW_CURVE_POINTS];
+	// Temperature channels to follow, 0 for all of them
+	unsigned long channels;
+	long hyst;
+	// Percent per second, 0 for no limit
+	unsigned int ramp;
+
+	long ref_temp;
+	// Last duty requested, negative before the first evaluation
+	int duty;
+	unsigned long evaluated_at;
+};
 
-	struct ec_params_pwm_set_keyboard_backlight *params = &buf.params;
-	struct cros_ec_command *msg = &buf.msg;
-	struct cros_ec_device *ec;
-	int ret;
+// Host commands whose supported versions are looked up at probe
+enum framework_ec_cap {
+	FW_CAP_CHARGE_LIMIT,
+	FW_CAP_PWM_GET_DUTY,
+	FW_CAP_KB_LED_SET,
+	FW_CAP_TEMP_INFO,
+	FW_CAP_FAN_TARGET_SET,
+	FW_CAP_FAN_TARGET_GET,
+	FW_CAP_AUTO_FAN,
+	FW_CAP_FAN_DUTY,
+	FW_CAP_PRIVACY,
+	FW_CAP_LED_CONTROL,
+	FW_CAP_POWER_INFO,
+	FW_CAP_COUNT,
+};
 
-	if (!ec_device)
-		return -EIO;
+static const u16 fw_cap_commands[FW_CAP_COUNT] = {
+	[FW_CAP_CHARGE_LIMIT] = EC_CMD_CHARGE_LIMIT_CONTROL,
+	[FW_CAP_PWM_GET_DUTY] = EC_CMD_PWM_GET_DUTY,
+	[FW_CAP_KB_LED_SET] = EC_CMD_PWM_SET_KEYBOARD_BACKLIGHT,
+	[FW_CAP_TEMP_INFO] = EC_CMD_TEMP_SENSOR_GET_INFO,
+	[FW_CAP_FAN_TARGET_SET] = EC_CMD_PWM_SET_FAN_TARGET_RPM,
+	[FW_CAP_FAN_TARGET_GET] = EC_CMD_PWM_GET_FAN_TARGET_RPM,
+	[FW_CAP_AUTO_FAN] = EC_CMD_THERMAL_AUTO_FAN_CTRL,
+	[FW_CAP_FAN_DUTY] = EC_CMD_PWM_SET_FAN_DUTY,
+	[FW_CAP_PRIVACY] = EC_CMD_PRIVACY_SWITCHES_CHECK_MODE,
+	[FW_CAP_LED_CONTROL] = EC_CMD_LED_CONTROL,
+	[FW_CAP_POWER_INFO] = EC_CMD_POWER_INFO,
+};
 
-	ec = dev_get_drvdata(ec_device);
+// Control writes go to the EC ahead of background reads
+enum framework_ec_class {
+	FW_EC_CONTROL,
+	FW_EC_BACKGROUND,
+	FW_EC_CLASSES,
+};
 
-	memset(&buf, 0, sizeof(buf));
-	
-	msg->version = 0;
-	msg->command = EC_CMD_PWM_SET_KEYBOARD_BACKLIGHT;
-	msg->insize = 0;
-	msg->outsize = sizeof(*params);
+struct framework_ec_queue {
+	unsigned int waiting;
+	unsigned int max_waiting;
+	u64 dispatched;
+};
 
-	params->percent = value;
+#define FW_STATS_ENTRIES 24
+#define FW_STATS_BUCKETS 32
+
+// Timing of one host command, or of reads from one memmap offset
+struct framework_ec_stats {
+	bool used;
+	bool readmem;
+	u32 id;
+	u64 calls;
+	u64 errors;
+	u64 total_ns;
+	u64 min_ns;
+	u64 max_ns;
+	// Bucket n counts calls that took [2^n, 2^(n+1)) ns
+	u64 hist[FW_STATS_BUCKETS];
+};
 
-	ret = cros_ec_cmd_xfer_status(ec, msg);
-	if (ret < 0) {
-		return -EIO;
-	}
+// A host command response, keyed by command, version and params
+struct framework_cache_entry {
+	bool valid;
+	int command;
+	unsigned int version;
+	size_t outsize;
+	size_t insize;
+	u8 params[FW_CACHE_DATA_SIZE];
+	u8 resp[FW_CACHE_DATA_SIZE];
+	unsigned long expires;
+};
 
-	return 0;
-}
+#define FW_INFLIGHT_ENTRIES 4
 
+// A cache fill in progress, which identical requests wait on instead of
+// sending their own
+struct framework_inflight {
+	bool active;
+	unsigned int waiters;
+	unsigned int gen;
+	struct framework_cache_entry key;
+	int ret;
+	struct completion done;
+};
 
-static ssize_t battery_get_threshold(char *buf)
+struct framework_data {
+	struct platform_device *pdev;
+	struct led_classdev kb_led;
+	// Keyboard backlight write-behind; kb_sent is negative when unknown
+	spinlock_t kb_lock;
+	struct work_struct kb_work;
+	bool kb_has_pending;
+	enum led_brightness kb_pending;
+	const char *kb_pending_origin;
+	enum led_brightness kb_brightness;
+	int kb_sent;
+	// Pattern or blink stepped by kb_timer, also under kb_lock
+	struct hrtimer kb_timer;
+	struct led_pattern kb_pattern[FW_KB_PATTERN_MAX];
+	u32 kb_pattern_len;
+	int kb_pattern_repeat;
+	u64 kb_pattern_period;
+	ktime_t kb_pattern_start;
+	bool kb_pattern_active;
+	struct device *hwmon_dev;
+	struct notifier_block ec_notifier;
+	// Counts for ec_events, and the events still to be sent as uevents
+	spinlock_t events_lock;
+	u32 event_counts[FW_EVENT_COUNT];
+	unsigned long events_pending;
+	struct work_struct events_work;
+	unsigned long fan_mask;
+	unsigned long temp_mask;
+	const char *temp_labels[EC_TEMP_SENSOR_ENTRIES];
+	bool has_battery;
+	bool battery_hooked;
+	// System power average, kept by the poller like the fan averages
+	spinlock_t power_lock;
+	bool power_has_average;
+	s64 power_average;	/* uW */
+	u64 power_average_at;
+	u32 power_average_interval;
+	struct framework_privacy privacy;
+	struct framework_fan fans[EC_FAN_SPEED_ENTRIES];
+	struct mutex curve_lock;
+	struct framework_fan_curve curves[EC_FAN_SPEED_ENTRIES];
+	// Per-fan results of the last fan_duty_all write, under curve_lock
+	size_t duty_all_count;
+	bool duty_all_sent[EC_FAN_SPEED_ENTRIES];
+	int duty_all_results[EC_FAN_SPEED_ENTRIES];
+
+	struct work_struct setup_work;
+	struct framework_ring *ring;
+	struct miscdevice ring_misc;
+	// Last charge limit set through the driver, negative if none
+	int charge_limit;
+	// Last charge limit read from or written to the EC, negative if unknown
+	int charge_limit_seen;
+	struct work_struct resume_work;
+	bool resume_fans_valid[EC_FAN_SPEED_ENTRIES];
+	struct framework_fan_request resume_fans[EC_FAN_SPEED_ENTRIES];
+	seqlock_t snapshot_lock;
+	struct framework_snapshot snapshot;
+	// Two works running the same poll, so that it can switch timers:
+	// poll_work is deferrable, poll_work_timely is scheduled instead
+	// while something depends on every sample. poll_mutex keeps them
+	// from polling at the same time.
+	struct delayed_work poll_work;
+	struct delayed_work poll_work_timely;
+	struct mutex poll_mutex;
+	unsigned int poll_interval;
+	// What the poller is actually using, between poll_interval and
+	// poll_interval_max
+	u32 poll_effective;
+	unsigned long last_read;
+	spinlock_t poll_lock;
+	bool poll_stopped;
+
+	spinlock_t cache_lock;
+	unsigned int cache_gen;
+	struct framework_cache_entry cache[FW_CACHE_ENTRIES];
+	struct framework_inflight inflight[FW_INFLIGHT_ENTRIES];
+	u64 cache_shared;
+
+	// Lets one host command through at a time, by priority
+	spinlock_t gate_lock;
+	wait_queue_head_t gate_wait;
+	bool gate_busy;
+	// Who holds the gate, and how many times; fw_ec_gate_enter() nests
+	struct task_struct *gate_owner;
+	unsigned int gate_depth;
+	struct framework_ec_queue queues[FW_EC_CLASSES];
+
+	// Version mask of each command in fw_cap_commands
+	u32 cmd_versions[FW_CAP_COUNT];
+
+	spinlock_t stats_lock;
+	struct framework_ec_stats stats[FW_STATS_ENTRIES];
+	struct dentry *debugfs;
+};
+
+// Used by the battery hook, which has no way to reach the platform device
+static struct framework_data *fwdata;
+
+// --- EC access ---
+// Every EC access in this driver goes through these, so that they can be
+// timed and traced. Stats entries are claimed on first use; anything past the
+// table is only counted in the last entry.
+static void fw_ec_stats_record(struct framework_data *data, bool readmem,
+			       u32 id, u64 ns, int ret)
 {
-	int ret;
+	struct framework_ec_stats *st = NULL;
+	size_t i;
+
+	spin_lock(&data->stats_lock);
+	for (i = 0; i < FW_STATS_ENTRIES; i++) {
+		st = &data->stats[i];
+		if (!st->used) {
+			st->used = true;
+			st->readmem = readmem;
+			st->id = id;
+			st->min_ns = U64_MAX;
+			break;
+		}
+		if (st->readmem == readmem && st->id == id)
+			break;
+	}
 
-	ret = charge_limit_control(CHG_LIMIT_GET_LIMIT, 0);
+	st->calls++;
 	if (ret < 0)
-		return ret;
-
-	return sysfs_emit(buf, "%d\n", (int)ret);
+		st->errors++;
+	st->total_ns += ns;
+	st->min_ns = min(st->min_ns, ns);
+	st->max_ns = max(st->max_ns, ns);
+	st->hist[min(fls64(ns | 1) - 1, FW_STATS_BUCKETS - 1)]++;
+	spin_unlock(&data->stats_lock);
 }
 
-static ssize_t battery_set_threshold(const char *buf, size_t count)
+static bool fw_ec_has(const struct framework_data *data,
+		      enum framework_ec_cap cap, unsigned int version)
 {
-	int ret;
-	int value;
+	return data->cmd_versions[cap] & EC_VER_MASK(version);
+}
 
-	ret = kstrtouint(buf, 10, &value);
-	if (ret)
-		return ret;
+// Don't bother the EC with commands it told us it doesn't have
+static bool fw_ec_supported(const struct framework_data *data, int command,
+			    unsigned int version)
+{
+	for (size_t i = 0; i < FW_CAP_COUNT; i++) {
+		if (fw_cap_commands[i] == command)
+			return fw_ec_has(data, i, version);
+	}
 
-	if (value > 100)
-		return -EINVAL;
+	return true;
+}
 
-	ret = charge_limit_control(CHG_LIMIT_SET_LIMIT, (uint8_t)value);
-	if (ret < 0)
-		return ret;
+// v1 of the fan commands addresses a single fan. v0 applies to all of them,
+// which is only the same thing when there is just one.
+static int fw_fan_cmd_version(const struct framework_data *data,
+			      enum framework_ec_cap cap)
+{
+	if (fw_ec_has(data, cap, 1))
+		return 1;
+	if (fw_ec_has(data, cap, 0) && hweight_long(data->fan_mask) <= 1)
+		return 0;
 
-	return count;
+	return -EOPNOTSUPP;
 }
 
-static ssize_t charge_control_end_threshold_show(struct device *dev,
-	struct device_attribute *attr, char *buf)
+// cros_ec serialises host commands on its own lock, in arrival order. Only
+// letting one of ours reach it at a time means a control write waits for at
+// most one command in flight, instead of a whole burst of reads.
+static bool fw_ec_gate_open(const struct framework_data *data,
+			    enum framework_ec_class cls)
 {
-	return battery_get_threshold(buf);
+	if (data->gate_busy)
+		return false;
+
+	for (int c = 0; c < cls; c++) {
+		if (data->queues[c].waiting)
+			return false;
+	}
+
+	return true;
 }
 
-static ssize_t charge_control_end_threshold_store(struct device *dev,
-	struct device_attribute *attr, const char *buf, size_t count)
+static void fw_ec_gate_enter(struct framework_data *data,
+			     enum framework_ec_class cls)
 {
-	return battery_set_threshold(buf, count);
+	struct framework_ec_queue *q = &data->queues[cls];
+
+	spin_lock(&data->gate_lock);
+	// Already ours, for a batch of commands sent back to back
+	if (data->gate_busy && data->gate_owner == current) {
+		data->gate_depth++;
+		q->dispatched++;
+		spin_unlock(&data->gate_lock);
+		return;
+	}
+	q->waiting++;
+	q->max_waiting = max(q->max_waiting, q->waiting);
+	wait_event_cmd(data->gate_wait, fw_ec_gate_open(data, cls),
+		       spin_unlock(&data->gate_lock),
+		       spin_lock(&data->gate_lock));
+	q->waiting--;
+	q->dispatched++;
+	data->gate_busy = true;
+	data->gate_owner = current;
+	data->gate_depth = 1;
+	spin_unlock(&data->gate_lock);
 }
 
-static DEVICE_ATTR_RW(charge_control_end_threshold);
-
-static struct attribute *framework_laptop_battery_attrs[] = {
-	&dev_attr_charge_control_end_threshold.attr,
-	NULL,
-};
+static void fw_ec_gate_exit(struct framework_data *data)
+{
+	spin_lock(&data->gate_lock);
+	if (--data->gate_depth) {
+		spin_unlock(&data->gate_lock);
+		return;
+	}
+	data->gate_busy = false;
+	data->gate_owner = NULL;
+	spin_unlock(&data->gate_lock);
 
-ATTRIBUTE_GROUPS(framework_laptop_battery);
+	wake_up_all(&data->gate_wait);
+}
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
-static int framework_laptop_battery_add(struct power_supply *battery, struct acpi_battery_hook *hook)
-#else
-static int framework_laptop_battery_add(struct power_supply *battery)
-#endif
+// origin names the attribute or work the command is for, and caller the
+// function that issued it, for the trace events
+static int __fw_ec_cmd(struct framework_data *data,
+		       enum framework_ec_class cls, unsigned int version,
+		       int command, const void *outdata, size_t outsize,
+		       void *indata, size_t insize, const char *origin,
+		       unsigned long caller)
 {
-	// Framework EC only supports 1 battery
-	if (strcmp(battery->desc->name, "BAT1") != 0)
-		return -ENODEV;
+	struct cros_ec_device *ec;
+	u64 start, ns;
+	int ret;
 
-	if (device_add_groups(&battery->dev, framework_laptop_battery_groups))
+	if (!ec_device)
 		return -ENODEV;
+	if (!fw_ec_supported(data, command, version))
+		return -EOPNOTSUPP;
 
-	return 0;
+	ec = dev_get_drvdata(ec_device);
+
+	fw_ec_gate_enter(data, cls);
+	trace_ec_cmd_start(command, version, outsize, insize, origin, caller);
+	start = ktime_get_ns();
+	ret = cros_ec_cmd(ec, version, command, outdata, outsize,
+			  indata, insize);
+	ns = ktime_get_ns() - start;
+	fw_ec_gate_exit(data);
+	trace_ec_cmd_end(command, version, ret, ns, origin, caller);
+	fw_ec_stats_record(data, false, command, ns, ret);
+
+	return ret;
 }
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
-static int framework_laptop_battery_remove(struct power_supply *battery, struct acpi_battery_hook *hook)
-#else
-static int framework_laptop_battery_remove(struct power_supply *battery)
-#endif
+// These are noinline so that _RET_IP_ names the function that issued the
+// command in the trace events
+static noinline int fw_ec_cmd(struct framework_data *data,
+			      enum framework_ec_class cls, unsigned int version,
+			      int command, const void *outdata, size_t outsize,
+			      void *indata, size_t insize, const char *origin)
 {
-	device_remove_groups(&battery->dev, framework_laptop_battery_groups);
-	return 0;
+	return __fw_ec_cmd(data, cls, version, command, outdata, outsize,
+			   indata, insize, origin, _RET_IP_);
 }
 
-// --- fanN_input ---
-// Read the current fan speed from the EC's memory
-static ssize_t ec_get_fan_speed(u8 idx, u16 *val)
+static noinline int fw_ec_xfer(struct framework_data *data,
+			       enum framework_ec_class cls,
+			       struct cros_ec_command *msg, const char *origin)
 {
+	struct cros_ec_device *ec;
+	u64 start, ns;
+	int ret;
+
 	if (!ec_device)
 		return -ENODEV;
+	if (!fw_ec_supported(data, msg->command, msg->version))
+		return -EOPNOTSUPP;
 
-	struct cros_ec_device *ec = dev_get_drvdata(ec_device);
+	ec = dev_get_drvdata(ec_device);
 
-	const u8 offset = EC_MEMMAP_FAN + 2 * idx;
+	fw_ec_gate_enter(data, cls);
+	trace_ec_cmd_start(msg->command, msg->version, msg->outsize,
+			   msg->insize, origin, _RET_IP_);
+	start = ktime_get_ns();
+	ret = cros_ec_cmd_xfer_status(ec, msg);
+	ns = ktime_get_ns() - start;
+	fw_ec_gate_exit(data);
+	trace_ec_cmd_end(msg->command, msg->version, ret, ns, origin, _RET_IP_);
+	fw_ec_stats_record(data, false, msg->command, ns, ret);
 
-	return ec->cmd_readmem(ec, offset, sizeof(*val), val);
+	return ret;
 }
 
-static ssize_t fw_fan_speed_show(struct device *dev,
-				 struct device_attribute *attr, char *buf)
+static noinline int fw_ec_readmem(struct framework_data *data,
+				  unsigned int offset, unsigned int bytes,
+				  void *dest, const char *origin)
 {
-	struct sensor_device_attribute *sen_attr = to_sensor_dev_attr(attr);
+	struct cros_ec_device *ec;
+	u64 start, ns;
+	int ret;
 
-	u16 val;
-	if (ec_get_fan_speed(sen_attr->index, &val) < 0) {
-		return -EIO;
-	}
+	if (!ec_device)
+		return -ENODEV;
 
-	if (val == EC_FAN_SPEED_NOT_PRESENT || val == EC_FAN_SPEED_STALLED) {
-		return sysfs_emit(buf, "%u\n", 0);
-	}
+	ec = dev_get_drvdata(ec_device);
 
-	// Format as string for sysfs
-	return sysfs_emit(buf, "%u\n", val);
+	start = ktime_get_ns();
+	ret = ec->cmd_readmem(ec, offset, bytes, dest);
+	ns = ktime_get_ns() - start;
+	trace_ec_readmem(offset, bytes, ret, ns, origin, _RET_IP_);
+	fw_ec_stats_record(data, true, offset, ns, ret);
+
+	return ret;
 }
 
-// --- fanN_target ---
-static ssize_t ec_set_target_rpm(u8 idx, u32 *val)
+// Ask the EC which versions of each command it supports. If it can't say,
+// assume everything is there, as the driver did before it asked.
+static void fw_ec_probe_caps(struct framework_data *data)
 {
+	struct ec_params_get_cmd_versions_v1 params;
+	struct ec_response_get_cmd_versions resp;
 	int ret;
-	if (!ec_device)
-		return -ENODEV;
 
-	struct cros_ec_device *ec = dev_get_drvdata(ec_device);
+	for (size_t i = 0; i < FW_CAP_COUNT; i++) {
+		params.cmd = fw_cap_commands[i];
+		ret = fw_ec_cmd(data, FW_EC_BACKGROUND, 1,
+				EC_CMD_GET_CMD_VERSIONS, &params,
+				sizeof(params), &resp, sizeof(resp), "setup");
+		if (ret >= 0)
+			data->cmd_versions[i] = resp.version_mask;
+		else if (ret == -EINVAL)
+			// EC_RES_INVALID_PARAM: the EC doesn't know the command
+			data->cmd_versions[i] = 0;
+		else
+			data->cmd_versions[i] = U32_MAX;
+	}
+}
 
-	struct ec_params_pwm_set_fan_target_rpm_v1 params = {
-		.rpm = *val,
-		.fan_idx = idx,
-	};
+static int fw_ec_caps_show(struct seq_file *s, void *unused)
+{
+	struct framework_data *data = s->private;
 
-	ret = cros_ec_cmd(ec, 1, EC_CMD_PWM_SET_FAN_TARGET_RPM, &params,
-			  sizeof(params), NULL, 0);
-	if (ret < 0)
-		return -EIO;
+	for (size_t i = 0; i < FW_CAP_COUNT; i++)
+		seq_printf(s, "cmd 0x%04x versions=0x%08x\n", fw_cap_commands[i],
+			   data->cmd_versions[i]);
 
 	return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(fw_ec_caps);
 
-static ssize_t ec_get_target_rpm(u8 idx, u32 *val)
+static int fw_ec_stats_show(struct seq_file *s, void *unused)
 {
-	int ret;
-	if (!ec_device)
-		return -ENODEV;
+	struct framework_data *data = s->private;
+	struct framework_ec_stats *stats;
 
-	struct cros_ec_device *ec = dev_get_drvdata(ec_device);
+	stats = kmalloc_array(FW_STATS_ENTRIES, sizeof(*stats), GFP_KERNEL);
+	if (!stats)
+		return -ENOMEM;
 
-	struct ec_response_pwm_get_fan_rpm resp;
+	spin_lock(&data->stats_lock);
+	memcpy(stats, data->stats, sizeof(data->stats));
+	spin_unlock(&data->stats_lock);
 
-	// index isn't supported, it should only return fan 0's target
+	for (size_t i = 0; i < FW_STATS_ENTRIES; i++) {
+		struct framework_ec_stats *st = &stats[i];
 
-	ret = cros_ec_cmd(ec, 0, EC_CMD_PWM_GET_FAN_TARGET_RPM, NULL, 0, &resp,
-			  sizeof(resp));
-	if (ret < 0)
-		return -EIO;
+		if (!st->used)
+			break;
 
-	*val = resp.rpm;
+		seq_printf(s, "%s 0x%04x calls=%llu errors=%llu min_ns=%llu mean_ns=%llu max_ns=%llu\n",
+			   st->readmem ? "readmem" : "cmd", st->id, st->calls,
+			   st->errors, st->min_ns, div64_u64(st->total_ns, st->calls),
+			   st->max_ns);
+
+		seq_puts(s, "  log2_ns");
+		for (size_t b = 0; b < FW_STATS_BUCKETS; b++) {
+			if (st->hist[b])
+				seq_printf(s, " %zu:%llu", b, st->hist[b]);
+		}
+		seq_puts(s, "\n");
+	}
 
+	kfree(stats);
 	return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(fw_ec_stats);
 
-static ssize_t fw_fan_target_store(struct device *dev,
-				   struct device_attribute *attr,
-				   const char *buf, size_t count)
+static int fw_ec_stats_reset(void *_data, u64 val)
 {
-	struct sensor_device_attribute *sen_attr = to_sensor_dev_attr(attr);
-	u32 val;
+	struct framework_data *data = _data;
 
-	int err;
-	err = kstrtou32(buf, 10, &val);
-	if (err < 0)
-		return err;
+	spin_lock(&data->stats_lock);
+	memset(data->stats, 0, sizeof(data->stats));
+	spin_unlock(&data->stats_lock);
 
-	if (ec_set_target_rpm(sen_attr->index, &val) < 0) {
-		return -EIO;
+	spin_lock(&data->gate_lock);
+	for (size_t i = 0; i < FW_EC_CLASSES; i++) {
+		data->queues[i].max_waiting = data->queues[i].waiting;
+		data->queues[i].dispatched = 0;
 	}
+	spin_unlock(&data->gate_lock);
 
-	return count;
+	spin_lock(&data->cache_lock);
+	data->cache_shared = 0;
+	spin_unlock(&data->cache_lock);
+
+	return 0;
 }
+DEFINE_DEBUGFS_ATTRIBUTE(fw_ec_stats_reset_fops, NULL, fw_ec_stats_reset, "%llu\n");
 
-static ssize_t fw_fan_target_show(struct device *dev,
-				  struct device_attribute *attr, char *buf)
+static int fw_ec_queue_show(struct seq_file *s, void *unused)
 {
-	struct sensor_device_attribute *sen_attr = to_sensor_dev_attr(attr);
+	static const char * const names[FW_EC_CLASSES] = {
+		[FW_EC_CONTROL] = "control",
+		[FW_EC_BACKGROUND] = "background",
+	};
+	struct framework_data *data = s->private;
+	struct framework_ec_queue queues[FW_EC_CLASSES];
+	u64 shared;
 
-	// Only fan 0 is supported
-	if (sen_attr->index != 0) {
-		return -EINVAL;
-	}
+	spin_lock(&data->gate_lock);
+	memcpy(queues, data->queues, sizeof(queues));
+	spin_unlock(&data->gate_lock);
 
-	u32 val;
-	if (ec_get_target_rpm(sen_attr->index, &val) < 0) {
-		return -EIO;
-	}
+	spin_lock(&data->cache_lock);
+	shared = data->cache_shared;
+	spin_unlock(&data->cache_lock);
 
-	// Format as string for sysfs
-	return sysfs_emit(buf, "%u\n", val);
+	for (size_t i = 0; i < FW_EC_CLASSES; i++)
+		seq_printf(s, "%s waiting=%u max_waiting=%u dispatched=%llu\n",
+			   names[i], queues[i].waiting, queues[i].max_waiting,
+			   queues[i].dispatched);
+	seq_printf(s, "shared_fills=%llu\n", shared);
+
+	return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(fw_ec_queue);
 
-// --- fanN_fault ---
-static ssize_t fw_fan_fault_show(struct device *dev,
-				 struct device_attribute *attr, char *buf)
+static void framework_debugfs_remove(void *_data)
 {
-	struct sensor_device_attribute *sen_attr = to_sensor_dev_attr(attr);
+	struct framework_data *data = _data;
+
+	debugfs_remove_recursive(data->debugfs);
+}
+
+// Lives under /sys/kernel/debug/framework_laptop/, until
+// framework_debugfs_remove()
+static void framework_debugfs_init(struct framework_data *data)
+{
+	data->debugfs = debugfs_create_dir(DRV_NAME, NULL);
+	debugfs_create_file("ec_stats", 0444, data->debugfs, data,
+			    &fw_ec_stats_fops);
+	debugfs_create_file_unsafe("ec_stats_reset", 0200, data->debugfs, data,
+				   &fw_ec_stats_reset_fops);
+	debugfs_create_file("ec_caps", 0444, data->debugfs, data,
+			    &fw_ec_caps_fops);
+	debugfs_create_file("ec_queue", 0444, data->debugfs, data,
+			    &fw_ec_queue_fops);
+	debugfs_create_u32("poll_interval", 0444, data->debugfs,
+			   &data->poll_effective);
+}
+
+// --- host command cache ---
+static bool fw_cache_match(const struct framework_cache_entry *entry,
+			   const struct framework_cache_entry *key)
+{
+	return entry->valid && entry->command == key->command &&
+	       entry->version == key->version &&
+	       entry->outsize == key->outsize && entry->insize == key->insize &&
+	       !memcmp(entry->params, key->params, key->outsize);
+}
+
+// Pick the slot to store a response in: the same key, a free slot, or the
+// entry closest to expiry
+static struct framework_cache_entry *
+fw_cache_slot(struct framework_data *data, const struct framework_cache_entry *key)
+{
+	struct framework_cache_entry *slot = &data->cache[0];
+
+	for (size_t i = 0; i < FW_CACHE_ENTRIES; i++) {
+		struct framework_cache_entry *entry = &data->cache[i];
+
+		if (!entry->valid || fw_cache_match(entry, key))
+			return entry;
+
+		if (time_before(entry->expires, slot->expires))
+			slot = entry;
+	}
+
+	return slot;
+}
+
+static void fw_ec_cache_invalidate(struct framework_data *data)
+{
+	spin_lock(&data->cache_lock);
+	data->cache_gen++;
+	for (size_t i = 0; i < FW_CACHE_ENTRIES; i++)
+		data->cache[i].valid = false;
+	spin_unlock(&data->cache_lock);
+}
+
+// Like cros_ec_cmd(), but answers from the cache if an identical command
+// was sent less than ttl milliseconds ago. outdata and indata may overlap.
+// Commands sent from here are traced as coming from our caller.
+static noinline int fw_ec_cmd_cached(struct framework_data *data,
+				     unsigned int version, int command,
+				     const void *outdata, size_t outsize,
+				     void *indata, size_t insize,
+				     unsigned int ttl, const char *origin)
+{
+	struct framework_cache_entry key = {
+		.valid = true,
+		.command = command,
+		.version = version,
+		.outsize = outsize,
+		.insize = insize,
+	};
+	struct framework_inflight *fill = NULL;
+	unsigned int gen;
+	int ret;
+
+	if (outsize > FW_CACHE_DATA_SIZE || insize > FW_CACHE_DATA_SIZE)
+		return __fw_ec_cmd(data, FW_EC_BACKGROUND, version, command,
+				   outdata, outsize, indata, insize, origin,
+				   _RET_IP_);
+
+	memcpy(key.params, outdata, outsize);
+
+	spin_lock(&data->cache_lock);
+	for (size_t i = 0; i < FW_CACHE_ENTRIES; i++) {
+		struct framework_cache_entry *entry = &data->cache[i];
+
+		if (fw_cache_match(entry, &key) &&
+		    time_before(jiffies, entry->expires)) {
+			memcpy(indata, entry->resp, insize);
+			spin_unlock(&data->cache_lock);
+			return insize;
+		}
+	}
+	gen = data->cache_gen;
+
+	// Share a fill of the same command that's already on its way, unless
+	// it was sent before an invalidation
+	for (size_t i = 0; i < FW_INFLIGHT_ENTRIES; i++) {
+		struct framework_inflight *inf = &data->inflight[i];
+
+		if (!inf->active || inf->gen != gen ||
+		    !fw_cache_match(&inf->key, &key))
+			continue;
+
+		inf->waiters++;
+		data->cache_shared++;
+		spin_unlock(&data->cache_lock);
+
+		wait_for_completion(&inf->done);
+
+		spin_lock(&data->cache_lock);
+		ret = inf->ret;
+		if (ret >= 0)
+			memcpy(indata, inf->key.resp, insize);
+		inf->waiters--;
+		spin_unlock(&data->cache_lock);
+		return ret;
+	}
+
+	for (size_t i = 0; i < FW_INFLIGHT_ENTRIES; i++) {
+		struct framework_inflight *inf = &data->inflight[i];
+
+		if (inf->active || inf->waiters)
+			continue;
+
+		fill = inf;
+		fill->active = true;
+		fill->gen = gen;
+		fill->key = key;
+		reinit_completion(&fill->done);
+		break;
+	}
+	spin_unlock(&data->cache_lock);
+
+	ret = __fw_ec_cmd(data, FW_EC_BACKGROUND, version, command,
+			  key.params, outsize, indata, insize, origin, _RET_IP_);
+	if (ret >= 0) {
+		memcpy(key.resp, indata, insize);
+		key.expires = jiffies + msecs_to_jiffies(ttl);
+	}
+
+	spin_lock(&data->cache_lock);
+	// Don't store a response that was in flight across an invalidation
+	if (ret >= 0 && gen == data->cache_gen)
+		*fw_cache_slot(data, &key) = key;
+	if (fill) {
+		fill->ret = ret;
+		fill->key = key;
+		fill->active = false;
+		complete_all(&fill->done);
+	}
+	spin_unlock(&data->cache_lock);
+
+	return ret;
+}
+
+static int charge_limit_control(struct framework_data *data,
+				enum ec_chg_limit_control_modes modes, uint8_t max_percentage,
+				const char *origin) {
+	struct {
+		struct cros_ec_command msg;
+		union {
+			struct ec_params_ec_chg_limit_control params;
+			struct ec_response_chg_limit_control resp;
+		};
+	} __packed buf;
+	struct ec_params_ec_chg_limit_control *params = &buf.params;
+	struct ec_response_chg_limit_control *resp = &buf.resp;
+	struct cros_ec_command *msg = &buf.msg;
+	int ret;
+
+	if (!ec_device)
+		return -ENODEV;
+
+	memset(&buf, 0, sizeof(buf));
+
+	msg->version = 0;
+	msg->command = EC_CMD_CHARGE_LIMIT_CONTROL;
+	msg->outsize = sizeof(*params);
+	msg->insize = sizeof(*resp);
+
+	params->modes = modes;
+	params->max_percentage = max_percentage;
 
-	u16 val;
-	if (ec_get_fan_speed(sen_attr->index, &val) < 0) {
+	if (modes == CHG_LIMIT_GET_LIMIT) {
+		ret = fw_ec_cmd_cached(data, msg->version, msg->command, params,
+				       msg->outsize, resp, msg->insize,
+				       FW_CACHE_TTL_CHARGE_LIMIT, origin);
+	} else {
+		ret = fw_ec_xfer(data, FW_EC_CONTROL, msg, origin);
+		fw_ec_cache_invalidate(data);
+	}
+	if (ret < 0) {
 		return -EIO;
 	}
 
-	// Format as string for sysfs
-	return sysfs_emit(buf, "%u\n", val == EC_FAN_SPEED_NOT_PRESENT);
+	WRITE_ONCE(data->charge_limit_seen,
+		   modes == CHG_LIMIT_GET_LIMIT ? resp->max_percentage :
+						  max_percentage);
+
+	return resp->max_percentage;
 }
 
-// --- fanN_alarm ---
-static ssize_t fw_fan_alarm_show(struct device *dev,
-				 struct device_attribute *attr, char *buf)
+// Read the keyboard LED brightness from the EC
+static int ec_get_kb_led(struct framework_data *data, const char *origin)
 {
-	struct sensor_device_attribute *sen_attr = to_sensor_dev_attr(attr);
+	struct {
+		struct cros_ec_command msg;
+		union {
+			struct ec_params_pwm_get_duty p;
+			struct ec_response_pwm_get_duty resp;
+		};
+	} __packed buf;
+
+	struct ec_params_pwm_get_duty *p = &buf.p;
+	struct ec_response_pwm_get_duty *resp = &buf.resp;
+	struct cros_ec_command *msg = &buf.msg;
+	int ret;
+	if (!ec_device)
+		return -EIO;
+
+	memset(&buf, 0, sizeof(buf));
+
+	p->pwm_type = EC_PWM_TYPE_KB_LIGHT;
+	
+	msg->version = 0;
+	msg->command = EC_CMD_PWM_GET_DUTY;
+	msg->insize = sizeof(*resp);
+	msg->outsize = sizeof(*p);
 
-	u16 val;
-	if (ec_get_fan_speed(sen_attr->index, &val) < 0) {
+	ret = fw_ec_cmd_cached(data, msg->version, msg->command, p, msg->outsize,
+			       resp, msg->insize, FW_CACHE_TTL_KB_LED, origin);
+	if (ret < 0) {
 		return -EIO;
 	}
 
-	// Format as string for sysfs
-	return sysfs_emit(buf, "%u\n", val == EC_FAN_SPEED_STALLED);
+	return resp->duty * 100 / EC_PWM_MAX_DUTY;
 }
 
-// --- pwmN_enable ---
-static ssize_t ec_set_auto_fan_ctrl(u8 idx)
+// Set the keyboard LED brightness on the EC
+static int ec_set_kb_led(struct framework_data *data, enum led_brightness value,
+			 const char *origin)
 {
+	struct {
+		struct cros_ec_command msg;
+		union {
+			struct ec_params_pwm_set_keyboard_backlight params;
+		};
+	} __packed buf;
+
+	struct ec_params_pwm_set_keyboard_backlight *params = &buf.params;
+	struct cros_ec_command *msg = &buf.msg;
 	int ret;
+
 	if (!ec_device)
-		return -ENODEV;
+		return -EIO;
+
+	memset(&buf, 0, sizeof(buf));
+	
+	msg->version = 0;
+	msg->command = EC_CMD_PWM_SET_KEYBOARD_BACKLIGHT;
+	msg->insize = 0;
+	msg->outsize = sizeof(*params);
+
+	params->percent = value;
+
+	ret = fw_ec_xfer(data, FW_EC_CONTROL, msg, origin);
+	fw_ec_cache_invalidate(data);
+	if (ret < 0) {
+		return -EIO;
+	}
+
+	return 0;
+}
+
+// Send the newest requested brightness. Anything requested while the EC
+// command is in flight is picked up on the next pass.
+static void kb_led_work(struct work_struct *work)
+{
+	struct framework_data *data = container_of(work, struct framework_data, kb_work);
+	enum led_brightness value;
+	const char *origin;
+	unsigned long flags;
+
+	for (;;) {
+		spin_lock_irqsave(&data->kb_lock, flags);
+		if (!data->kb_has_pending || data->kb_pending == data->kb_sent) {
+			data->kb_has_pending = false;
+			spin_unlock_irqrestore(&data->kb_lock, flags);
+			return;
+		}
+		value = data->kb_pending;
+		origin = data->kb_pending_origin;
+		data->kb_has_pending = false;
+		data->kb_sent = value;
+		spin_unlock_irqrestore(&data->kb_lock, flags);
+
+		if (ec_set_kb_led(data, value, origin) < 0) {
+			spin_lock_irqsave(&data->kb_lock, flags);
+			data->kb_sent = -1;
+			spin_unlock_irqrestore(&data->kb_lock, flags);
+		}
+	}
+}
+
+// Get the last set keyboard LED brightness
+static enum led_brightness kb_led_get(struct led_classdev *led)
+{
+	struct framework_data *data = container_of(led, struct framework_data, kb_led);
+
+	return READ_ONCE(data->kb_brightness);
+}
+
+// Hand a brightness to kb_led_work. Called with kb_lock held.
+static void kb_led_queue(struct framework_data *data, enum led_brightness value,
+			 const char *origin)
+{
+	if (data->kb_has_pending) {
+		data->kb_pending = value;
+		data->kb_pending_origin = origin;
+	} else if (value != data->kb_sent) {
+		data->kb_pending = value;
+		data->kb_pending_origin = origin;
+		data->kb_has_pending = true;
+		queue_work(fw_wq, &data->kb_work);
+	}
+}
+
+// Set the keyboard LED brightness. This may be called from atomic context, so
+// only record the value and let kb_led_work send it.
+static void kb_led_set(struct led_classdev *led, enum led_brightness value)
+{
+	struct framework_data *data = container_of(led, struct framework_data, kb_led);
+	unsigned long flags;
+
+	spin_lock_irqsave(&data->kb_lock, flags);
+	WRITE_ONCE(data->kb_brightness, value);
+	// Turning the LED off also stops a pattern or blink
+	if (value == LED_OFF)
+		data->kb_pattern_active = false;
+	kb_led_queue(data, value, "brightness");
+	spin_unlock_irqrestore(&data->kb_lock, flags);
+}
+
+// Work out the pattern brightness @ms into it, and for how many milliseconds
+// it's worth waiting before looking again. *next is 0 once the pattern is
+// done. Points follow ledtrig-pattern: the brightness ramps to the next point
+// over delta_t, and a point with a delta_t of 0 makes a step.
+static int kb_pattern_eval(struct framework_data *data, u64 ms, u32 *next)
+{
+	u32 len = data->kb_pattern_len;
+	u64 cycles, pos;
+
+	cycles = div64_u64_rem(ms, data->kb_pattern_period, &pos);
+	if (data->kb_pattern_repeat > 0 && cycles >= data->kb_pattern_repeat) {
+		*next = 0;
+		return data->kb_pattern[len - 1].brightness;
+	}
+
+	for (u32 i = 0; i < len; i++) {
+		u32 delta_t = data->kb_pattern[i].delta_t;
+		int from = data->kb_pattern[i].brightness;
+		int to = data->kb_pattern[(i + 1) % len].brightness;
+		u32 left, step;
+
+		if (pos >= delta_t) {
+			pos -= delta_t;
+			continue;
+		}
+
+		left = delta_t - pos;
+		if (from == to) {
+			*next = left;
+			return from;
+		}
+
+		// The EC takes whole percent, the same as max_brightness, so
+		// there's nothing to gain from waking up more than once per
+		// brightness step
+		step = max_t(u32, delta_t / abs(to - from), FW_KB_PATTERN_TICK);
+		*next = min(step, left);
+		return from + (int)div_s64((s64)(to - from) * pos, delta_t);
+	}
+
+	// Not reached, pos is always less than the period
+	*next = 0;
+	return data->kb_pattern[len - 1].brightness;
+}
+
+static enum hrtimer_restart kb_led_timer(struct hrtimer *timer)
+{
+	struct framework_data *data =
+		container_of(timer, struct framework_data, kb_timer);
+	unsigned long flags;
+	u32 next;
+	int value;
+
+	spin_lock_irqsave(&data->kb_lock, flags);
+	if (!data->kb_pattern_active) {
+		spin_unlock_irqrestore(&data->kb_lock, flags);
+		return HRTIMER_NORESTART;
+	}
+
+	value = kb_pattern_eval(data, ktime_ms_delta(ktime_get(),
+						     data->kb_pattern_start),
+				&next);
+	kb_led_queue(data, value, "pattern");
+	if (!next)
+		data->kb_pattern_active = false;
+	spin_unlock_irqrestore(&data->kb_lock, flags);
+
+	if (!next)
+		return HRTIMER_NORESTART;
+
+	hrtimer_forward_now(timer, ms_to_ktime(next));
+	return HRTIMER_RESTART;
+}
+
+// (Re)start the pattern from its first point
+static void kb_pattern_start(struct framework_data *data)
+{
+	unsigned long flags;
+	bool active;
+
+	spin_lock_irqsave(&data->kb_lock, flags);
+	data->kb_pattern_start = ktime_get();
+	active = data->kb_pattern_active;
+	spin_unlock_irqrestore(&data->kb_lock, flags);
+
+	if (active)
+		hrtimer_start(&data->kb_timer, 0, HRTIMER_MODE_REL);
+}
+
+static int kb_pattern_load(struct framework_data *data,
+			   const struct led_pattern *pattern, u32 len,
+			   int repeat)
+{
+	unsigned long flags;
+	u64 period = 0;
+	bool steady = true;
+
+	if (!len || len > FW_KB_PATTERN_MAX)
+		return -EINVAL;
+
+	for (u32 i = 0; i < len; i++) {
+		if (pattern[i].brightness < 0 ||
+		    pattern[i].brightness > data->kb_led.max_brightness)
+			return -EINVAL;
+		if (pattern[i].brightness != pattern[0].brightness)
+			steady = false;
+		period += pattern[i].delta_t;
+	}
+
+	hrtimer_cancel(&data->kb_timer);
+
+	spin_lock_irqsave(&data->kb_lock, flags);
+	memcpy(data->kb_pattern, pattern, len * sizeof(*pattern));
+	data->kb_pattern_len = len;
+	data->kb_pattern_repeat = repeat;
+	data->kb_pattern_period = period;
+	// A pattern that never changes only needs the one command
+	data->kb_pattern_active = period && !steady;
+	if (!data->kb_pattern_active)
+		kb_led_queue(data, pattern[0].brightness, "pattern");
+	spin_unlock_irqrestore(&data->kb_lock, flags);
+
+	kb_pattern_start(data);
+	return 0;
+}
+
+static int kb_led_pattern_set(struct led_classdev *led,
+			      struct led_pattern *pattern, u32 len, int repeat)
+{
+	struct framework_data *data = container_of(led, struct framework_data, kb_led);
+
+	return kb_pattern_load(data, pattern, len, repeat);
+}
+
+static int kb_led_pattern_clear(struct led_classdev *led)
+{
+	struct framework_data *data = container_of(led, struct framework_data, kb_led);
+	unsigned long flags;
+
+	spin_lock_irqsave(&data->kb_lock, flags);
+	data->kb_pattern_active = false;
+	spin_unlock_irqrestore(&data->kb_lock, flags);
+
+	hrtimer_cancel(&data->kb_timer);
+	return 0;
+}
+
+static int kb_led_blink_set(struct led_classdev *led, unsigned long *delay_on,
+			    unsigned long *delay_off)
+{
+	struct framework_data *data = container_of(led, struct framework_data, kb_led);
+	enum led_brightness on = READ_ONCE(data->kb_brightness) ?: led->max_brightness;
+	struct led_pattern pattern[4];
+
+	if (!*delay_on && !*delay_off) {
+		*delay_on = FW_KB_BLINK_DEFAULT;
+		*delay_off = FW_KB_BLINK_DEFAULT;
+	}
+	*delay_on = min_t(unsigned long, *delay_on, U32_MAX);
+	*delay_off = min_t(unsigned long, *delay_off, U32_MAX);
+
+	// A square wave: hold on, step off, hold off, step on
+	pattern[0] = (struct led_pattern){ .brightness = on, .delta_t = *delay_on };
+	pattern[1] = (struct led_pattern){ .brightness = on, .delta_t = 0 };
+	pattern[2] = (struct led_pattern){ .brightness = LED_OFF, .delta_t = *delay_off };
+	pattern[3] = (struct led_pattern){ .brightness = LED_OFF, .delta_t = 0 };
+
+	return kb_pattern_load(data, pattern, ARRAY_SIZE(pattern), -1);
+}
+
+// Send the last requested brightness before the driver goes away
+static void kb_led_flush(void *_data)
+{
+	struct framework_data *data = _data;
+
+	kb_led_pattern_clear(&data->kb_led);
+	flush_work(&data->kb_work);
+}
+
+// --- EC LEDs ---
+#if IS_ENABLED(CONFIG_LEDS_CLASS_MULTICOLOR)
+struct framework_ec_led {
+	struct framework_data *data;
+	struct led_classdev_mc mc;
+	struct mc_subled subled[EC_LED_COLOR_COUNT];
+	u8 led_id;
+	// EC color of each subled
+	u8 color[EC_LED_COLOR_COUNT];
+};
+
+static const char * const fw_ec_led_names[] = {
+	[EC_LED_ID_BATTERY_LED] = "battery",
+	[EC_LED_ID_POWER_LED] = "power",
+	[EC_LED_ID_ADAPTER_LED] = "adapter",
+	[EC_LED_ID_LEFT_LED] = "left",
+	[EC_LED_ID_RIGHT_LED] = "right",
+};
+
+static const u8 fw_ec_led_colors[EC_LED_COLOR_COUNT] = {
+	[EC_LED_COLOR_RED] = LED_COLOR_ID_RED,
+	[EC_LED_COLOR_GREEN] = LED_COLOR_ID_GREEN,
+	[EC_LED_COLOR_BLUE] = LED_COLOR_ID_BLUE,
+	[EC_LED_COLOR_YELLOW] = LED_COLOR_ID_YELLOW,
+	[EC_LED_COLOR_WHITE] = LED_COLOR_ID_WHITE,
+	[EC_LED_COLOR_AMBER] = LED_COLOR_ID_AMBER,
+};
+
+// Only the EC LEDs can use this trigger
+static struct led_hw_trigger_type fw_ec_led_trigger_type;
+
+static int fw_ec_led_control(struct framework_data *data, u8 led_id, u8 flags,
+			     const u8 *brightness,
+			     struct ec_response_led_control *resp,
+			     const char *origin)
+{
+	struct ec_params_led_control params = {
+		.led_id = led_id,
+		.flags = flags,
+	};
+
+	if (brightness)
+		memcpy(params.brightness, brightness, sizeof(params.brightness));
+
+	return fw_ec_cmd(data, FW_EC_CONTROL, 1, EC_CMD_LED_CONTROL, &params,
+			 sizeof(params), resp, sizeof(*resp), origin);
+}
+
+// Hand the LED back to the EC, which shows charge and power state on it
+static int fw_ec_led_trigger_activate(struct led_classdev *led)
+{
+	struct framework_ec_led *ec_led =
+		container_of(lcdev_to_mccdev(led), struct framework_ec_led, mc);
+	struct ec_response_led_control resp;
+	int ret;
+
+	ret = fw_ec_led_control(ec_led->data, ec_led->led_id, EC_LED_FLAGS_AUTO,
+				NULL, &resp, led->name);
+	return ret < 0 ? ret : 0;
+}
+
+static struct led_trigger fw_ec_led_trigger = {
+	.name = DRV_NAME "-auto",
+	.activate = fw_ec_led_trigger_activate,
+	.trigger_type = &fw_ec_led_trigger_type,
+};
+
+// All colors go to the EC in one command, so the LED never shows half of a
+// color change
+static int fw_ec_led_set(struct led_classdev *led, enum led_brightness value)
+{
+	struct led_classdev_mc *mc = lcdev_to_mccdev(led);
+	struct framework_ec_led *ec_led =
+		container_of(mc, struct framework_ec_led, mc);
+	struct ec_response_led_control resp;
+	u8 brightness[EC_LED_COLOR_COUNT] = { 0 };
+	int ret;
+
+	led_mc_calc_color_components(mc, value);
+	for (unsigned int i = 0; i < mc->num_colors; i++)
+		brightness[ec_led->color[i]] = mc->subled_info[i].brightness;
+
+	ret = fw_ec_led_control(ec_led->data, ec_led->led_id, 0, brightness,
+				&resp, led->name);
+	return ret < 0 ? ret : 0;
+}
+
+// Register the LED if the EC has it, with one subled per color it supports
+static int fw_ec_led_register(struct device *dev, struct framework_data *data,
+			      u8 led_id)
+{
+	struct ec_response_led_control resp;
+	struct framework_ec_led *ec_led;
+	unsigned int max_brightness = 0;
+	unsigned int n = 0;
+	int ret;
+
+	ret = fw_ec_led_control(data, led_id, EC_LED_FLAGS_QUERY, NULL, &resp,
+				"setup");
+	if (ret < 0)
+		return 0;
+
+	// The EC answers for LEDs this model doesn't have with no colors
+	for (u8 c = 0; c < EC_LED_COLOR_COUNT; c++)
+		max_brightness = max_t(unsigned int, max_brightness,
+				       resp.brightness_range[c]);
+	if (!max_brightness)
+		return 0;
+
+	ec_led = devm_kzalloc(dev, sizeof(*ec_led), GFP_KERNEL);
+	if (!ec_led)
+		return -ENOMEM;
+
+	for (u8 c = 0; c < EC_LED_COLOR_COUNT; c++) {
+		if (!resp.brightness_range[c])
+			continue;
+
+		ec_led->color[n] = c;
+		ec_led->subled[n].color_index = fw_ec_led_colors[c];
+		ec_led->subled[n].intensity = resp.brightness_range[c];
+		ec_led->subled[n].channel = c;
+		n++;
+	}
+
+	ec_led->data = data;
+	ec_led->led_id = led_id;
+	ec_led->mc.num_colors = n;
+	ec_led->mc.subled_info = ec_led->subled;
+
+	ec_led->mc.led_cdev.name = devm_kasprintf(dev, GFP_KERNEL,
+						  DRV_NAME ":multicolor:%s",
+						  fw_ec_led_names[led_id]);
+	if (!ec_led->mc.led_cdev.name)
+		return -ENOMEM;
+	// Subled brightness is scaled by brightness / max_brightness, so a
+	// color's intensity is in the EC's own range for it
+	ec_led->mc.led_cdev.max_brightness = max_brightness;
+	ec_led->mc.led_cdev.brightness_set_blocking = fw_ec_led_set;
+	ec_led->mc.led_cdev.trigger_type = &fw_ec_led_trigger_type;
+	ec_led->mc.led_cdev.default_trigger = fw_ec_led_trigger.name;
+
+	return devm_led_classdev_multicolor_register(dev, &ec_led->mc);
+}
+
+// cros_ec_dev adds a cros-ec-led cell for ECs that advertise their LEDs
+static int device_match_cros_ec_led(struct device *dev, const void *ec)
+{
+	return !strncmp(dev_name(dev), "cros-ec-led", 11) &&
+	       dev->parent && dev->parent->parent == ec;
+}
+
+// Whether leds-cros_ec has (or will have) the same LEDs
+static bool framework_ec_leds_taken(void)
+{
+	struct device *led_dev;
+	bool taken;
+
+	led_dev = bus_find_device(&platform_bus_type, NULL, ec_device,
+				  device_match_cros_ec_led);
+	if (!led_dev)
+		return false;
+
+	taken = device_is_bound(led_dev) || IS_ENABLED(CONFIG_LEDS_CROS_EC);
+	put_device(led_dev);
+	return taken;
+}
+
+static int framework_ec_leds_register(struct device *dev,
+				      struct framework_data *data)
+{
+	int ret;
+
+	if (!fw_ec_has(data, FW_CAP_LED_CONTROL, 1))
+		return 0;
+
+	if (framework_ec_leds_taken()) {
+		dev_info(dev, DRV_NAME ": EC LEDs are handled by leds-cros_ec.\n");
+		return 0;
+	}
+
+	ret = devm_led_trigger_register(dev, &fw_ec_led_trigger);
+	if (ret)
+		return ret;
+
+	for (u8 id = 0; id < ARRAY_SIZE(fw_ec_led_names); id++) {
+		ret = fw_ec_led_register(dev, data, id);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+#else
+static int framework_ec_leds_register(struct device *dev,
+				      struct framework_data *data)
+{
+	return 0;
+}
+#endif
+
+
+// --- battery telemetry ---
+// Read the battery block from the last memmap snapshot
+static ssize_t ec_get_battery(struct framework_data *data,
+			      struct framework_memmap_battery *val)
+{
+	unsigned int seq;
+	ssize_t ret;
+
+	do {
+		seq = read_seqbegin(&data->snapshot_lock);
+		ret = data->snapshot.battery_status;
+		*val = data->snapshot.battery;
+	} while (read_seqretry(&data->snapshot_lock, seq));
+
+	if (ret < 0)
+		return ret;
+
+	if (!(val->flag & EC_BATT_FLAG_BATT_PRESENT))
+		return -ENODATA;
+
+	return 0;
+}
+
+// Remaining capacity in uAh, like power_supply's charge_now
+static ssize_t ec_charge_now_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct framework_memmap_battery battery;
+	ssize_t ret;
+
+	if (!fwdata)
+		return -ENODEV;
+
+	ret = ec_get_battery(fwdata, &battery);
+	if (ret < 0)
+		return ret;
+
+	return sysfs_emit(buf, "%u\n", battery.cap * 1000);
+}
+
+static DEVICE_ATTR_RO(ec_charge_now);
+
+static ssize_t battery_get_threshold(char *buf)
+{
+	int ret;
+
+	ret = charge_limit_control(fwdata, CHG_LIMIT_GET_LIMIT, 0,
+				   "charge_control_end_threshold");
+	if (ret < 0)
+		return ret;
+
+	return sysfs_emit(buf, "%d\n", (int)ret);
+}
+
+static ssize_t battery_set_threshold(const char *buf, size_t count)
+{
+	int ret;
+	int value;
+
+	ret = kstrtouint(buf, 10, &value);
+	if (ret)
+		return ret;
+
+	if (value > 100)
+		return -EINVAL;
+
+	ret = charge_limit_control(fwdata, CHG_LIMIT_SET_LIMIT, (uint8_t)value,
+				   "charge_control_end_threshold");
+	if (ret < 0)
+		return ret;
+
+	// Restored on resume
+	WRITE_ONCE(fwdata->charge_limit, value);
+
+	return count;
+}
+
+static ssize_t charge_control_end_threshold_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	return battery_get_threshold(buf);
+}
+
+static ssize_t charge_control_end_threshold_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	return battery_set_threshold(buf, count);
+}
+
+static DEVICE_ATTR_RW(charge_control_end_threshold);
+
+static struct attribute *framework_laptop_battery_attrs[] = {
+	&dev_attr_charge_control_end_threshold.attr,
+	&dev_attr_ec_charge_now.attr,
+	NULL,
+};
+
+static umode_t framework_laptop_battery_is_visible(struct kobject *kobj,
+						   struct attribute *attr, int n)
+{
+	if (attr == &dev_attr_charge_control_end_threshold.attr &&
+	    !(fwdata && fw_ec_has(fwdata, FW_CAP_CHARGE_LIMIT, 0)))
+		return 0;
+
+	return attr->mode;
+}
+
+static const struct attribute_group framework_laptop_battery_group = {
+	.attrs = framework_laptop_battery_attrs,
+	.is_visible = framework_laptop_battery_is_visible,
+};
+
+__ATTRIBUTE_GROUPS(framework_laptop_battery);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+static int framework_laptop_battery_add(struct power_supply *battery, struct acpi_battery_hook *hook)
+#else
+static int framework_laptop_battery_add(struct power_supply *battery)
+#endif
+{
+	// Framework EC only supports 1 battery
+	if (strcmp(battery->desc->name, "BAT1") != 0)
+		return -ENODEV;
+
+	if (device_add_groups(&battery->dev, framework_laptop_battery_groups))
+		return -ENODEV;
+
+	return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+static int framework_laptop_battery_remove(struct power_supply *battery, struct acpi_battery_hook *hook)
+#else
+static int framework_laptop_battery_remove(struct power_supply *battery)
+#endif
+{
+	device_remove_groups(&battery->dev, framework_laptop_battery_groups);
+	return 0;
+}
+
+// --- memmap poller ---
+// Read the temperature and fan blocks from the EC's memory in one go, then
+// the battery block, and publish them
+static void framework_update_snapshot(struct framework_data *data,
+				      const char *origin)
+{
+	struct framework_memmap_thermal thermal;
+	struct framework_memmap_battery battery;
+	struct ec_response_power_info power;
+	int ret, battery_ret, power_ret;
+
+	ret = fw_ec_readmem(data, EC_MEMMAP_TEMP_SENSOR, sizeof(thermal),
+			    &thermal, origin);
+	battery_ret = fw_ec_readmem(data, EC_MEMMAP_BATT_VOLT, sizeof(battery),
+				    &battery, origin);
+	power_ret = -EOPNOTSUPP;
+	if (fw_ec_has(data, FW_CAP_POWER_INFO, 0))
+		power_ret = fw_ec_cmd(data, FW_EC_BACKGROUND, 0,
+				      EC_CMD_POWER_INFO, NULL, 0, &power,
+				      sizeof(power), origin);
+
+	write_seqlock(&data->snapshot_lock);
+	data->snapshot.timestamp = ktime_get_ns();
+	if (ret < 0) {
+		data->snapshot.status = -EIO;
+	} else {
+		data->snapshot.status = 0;
+		memcpy(data->snapshot.temps, thermal.temps, sizeof(thermal.temps));
+		memcpy(data->snapshot.fans, thermal.fans, sizeof(thermal.fans));
+	}
+	if (battery_ret < 0) {
+		data->snapshot.battery_status = -EIO;
+	} else {
+		data->snapshot.battery_status = 0;
+		data->snapshot.battery = battery;
+	}
+	if (power_ret < 0) {
+		data->snapshot.power_status = power_ret;
+	} else {
+		data->snapshot.power_status = 0;
+		data->snapshot.power = power;
+	}
+	write_sequnlock(&data->snapshot_lock);
+}
+
+// Copy the whole snapshot in a single read section
+static void framework_read_snapshot(struct framework_data *data,
+				    struct framework_snapshot *snap)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&data->snapshot_lock);
+		*snap = data->snapshot;
+	} while (read_seqretry(&data->snapshot_lock, seq));
+}
+
+static unsigned long framework_poll_delay(struct framework_data *data)
+{
+	return msecs_to_jiffies(READ_ONCE(data->poll_effective));
+}
+
+// A telemetry reader or a fan curve is waiting for the next sample, which
+// must not be held back until the CPU wakes up for something else
+static bool framework_poll_timely(struct framework_data *data)
+{
+	if (data->ring && atomic_read(&data->ring->users))
+		return true;
+
+	for (size_t i = 0; i < EC_FAN_SPEED_ENTRIES; i++) {
+		if (READ_ONCE(data->curves[i].enabled))
+			return true;
+	}
+
+	return false;
+}
+
+// (Re)schedule the poller, unless framework_poll_stop() has been called
+static void framework_poll_kick(struct framework_data *data, unsigned long delay)
+{
+	struct delayed_work *work = &data->poll_work;
+	struct delayed_work *other = &data->poll_work_timely;
+
+	if (framework_poll_timely(data))
+		swap(work, other);
+
+	spin_lock(&data->poll_lock);
+	if (!data->poll_stopped) {
+		cancel_delayed_work(other);
+		mod_delayed_work(fw_wq, work, delay);
+	}
+	spin_unlock(&data->poll_lock);
+}
+
+static void framework_poll_stop(struct framework_data *data)
+{
+	spin_lock(&data->poll_lock);
+	data->poll_stopped = true;
+	spin_unlock(&data->poll_lock);
+
+	cancel_delayed_work_sync(&data->poll_work);
+	cancel_delayed_work_sync(&data->poll_work_timely);
+}
+
+// Someone is reading the snapshot, so get back to the fast rate
+static void framework_poll_touch(struct framework_data *data)
+{
+	// No poller without hwmon
+	if (!data->hwmon_dev)
+		return;
+
+	WRITE_ONCE(data->last_read, jiffies);
+	if (READ_ONCE(data->poll_effective) > READ_ONCE(data->poll_interval)) {
+		WRITE_ONCE(data->poll_effective, READ_ONCE(data->poll_interval));
+		framework_poll_kick(data, 0);
+	}
+}
+
+// Undo framework_poll_stop() and take a snapshot right away
+static void framework_poll_start(struct framework_data *data)
+{
+	spin_lock(&data->poll_lock);
+	data->poll_stopped = false;
+	spin_unlock(&data->poll_lock);
+
+	WRITE_ONCE(data->poll_effective, READ_ONCE(data->poll_interval));
+
+	framework_poll_kick(data, 0);
+}
+
+// --- fanN_input ---
+// Read the current fan speed from the last memmap snapshot
+static ssize_t ec_get_fan_speed(struct framework_data *data, u8 idx, u16 *val)
+{
+	unsigned int seq;
+	ssize_t ret;
+
+	do {
+		seq = read_seqbegin(&data->snapshot_lock);
+		ret = data->snapshot.status;
+		*val = data->snapshot.fans[idx];
+	} while (read_seqretry(&data->snapshot_lock, seq));
+
+	return ret;
+}
+
+// --- tempN_input ---
+// Read the raw temperature (in K minus EC_TEMP_SENSOR_OFFSET) from the last
+// memmap snapshot
+static ssize_t ec_get_temp(struct framework_data *data, u8 idx, u8 *val)
+{
+	unsigned int seq;
+	ssize_t ret;
+
+	do {
+		seq = read_seqbegin(&data->snapshot_lock);
+		ret = data->snapshot.status;
+		*val = data->snapshot.temps[idx];
+	} while (read_seqretry(&data->snapshot_lock, seq));
+
+	return ret;
+}
+
+// Find the present temperature sensors and look up their names once
+static ssize_t ec_probe_temps(struct framework_data *data)
+{
+	struct device *dev = &data->pdev->dev;
+	struct ec_params_temp_sensor_get_info params;
+	struct ec_response_temp_sensor_get_info resp;
+	u8 temp;
+	int ret;
+
+	data->temp_mask = 0;
+
+	for (size_t i = 0; i < EC_TEMP_SENSOR_ENTRIES; i++) {
+		if (ec_get_temp(data, i, &temp) < 0)
+			return -EIO;
+
+		if (temp == EC_TEMP_SENSOR_NOT_PRESENT)
+			continue;
+
+		data->temp_mask |= BIT(i);
+
+		params.id = i;
+		ret = fw_ec_cmd(data, FW_EC_BACKGROUND, 0,
+				EC_CMD_TEMP_SENSOR_GET_INFO, &params,
+				sizeof(params), &resp, sizeof(resp), "setup");
+		if (ret < 0)
+			continue;
+
+		data->temp_labels[i] = devm_kasprintf(dev, GFP_KERNEL, "%.*s",
+						      (int)sizeof(resp.sensor_name),
+						      resp.sensor_name);
+	}
+
+	return 0;
+}
+
+// --- fanN_target ---
+static ssize_t ec_set_target_rpm(struct framework_data *data, u8 idx, u32 *val,
+				 const char *origin)
+{
+	int ret;
+	if (!ec_device)
+		return -ENODEV;
+
+	int version = fw_fan_cmd_version(data, FW_CAP_FAN_TARGET_SET);
+	if (version < 0)
+		return version;
+
+	struct ec_params_pwm_set_fan_target_rpm_v1 params = {
+		.rpm = *val,
+		.fan_idx = idx,
+	};
+
+	// v0 is v1 without the fan index
+	static_assert(offsetof(struct ec_params_pwm_set_fan_target_rpm_v1, rpm) == 0);
+	ret = fw_ec_cmd(data, FW_EC_CONTROL, version,
+			EC_CMD_PWM_SET_FAN_TARGET_RPM, &params,
+			version ? sizeof(params) :
+				  sizeof(struct ec_params_pwm_set_fan_target_rpm_v0),
+			NULL, 0, origin);
+	fw_ec_cache_invalidate(data);
+	if (ret < 0)
+		return -EIO;
+
+	return 0;
+}
+
+static ssize_t ec_get_target_rpm(struct framework_data *data, u8 idx, u32 *val,
+				 const char *origin)
+{
+	int ret;
+	if (!ec_device)
+		return -ENODEV;
+
+	struct ec_response_pwm_get_fan_rpm resp;
+
+	// index isn't supported, it should only return fan 0's target
+
+	ret = fw_ec_cmd_cached(data, 0, EC_CMD_PWM_GET_FAN_TARGET_RPM, NULL, 0,
+			       &resp, sizeof(resp), FW_CACHE_TTL_FAN_TARGET,
+			       origin);
+	if (ret < 0)
+		return -EIO;
+
+	*val = resp.rpm;
+
+	return 0;
+}
+
+// --- pwmN_enable ---
+static ssize_t ec_set_auto_fan_ctrl(struct framework_data *data, u8 idx,
+				    const char *origin)
+{
+	int ret;
+	if (!ec_device)
+		return -ENODEV;
+
+	int version = fw_fan_cmd_version(data, FW_CAP_AUTO_FAN);
+	if (version < 0)
+		return version;
+
+	struct ec_params_auto_fan_ctrl_v1 params = {
+		.fan_idx = idx,
+	};
+
+	// v0 takes no parameters
+	ret = fw_ec_cmd(data, FW_EC_CONTROL, version,
+			EC_CMD_THERMAL_AUTO_FAN_CTRL, &params,
+			version ? sizeof(params) : 0, NULL, 0, origin);
+	fw_ec_cache_invalidate(data);
+	if (ret < 0)
+		return -EIO;
+
+	return 0;
+}
+
+// --- pwmN ---
+static ssize_t ec_set_fan_duty(struct framework_data *data, u8 idx, u32 *val,
+			       const char *origin)
+{
+	int ret;
+	if (!ec_device)
+		return -ENODEV;
+
+	int version = fw_fan_cmd_version(data, FW_CAP_FAN_DUTY);
+	if (version < 0)
+		return version;
+
+	struct ec_params_pwm_set_fan_duty_v1 params = {
+		.percent = *val,
+		.fan_idx = idx,
+	};
+
+	// v0 is v1 without the fan index
+	static_assert(offsetof(struct ec_params_pwm_set_fan_duty_v1, percent) == 0);
+	ret = fw_ec_cmd(data, FW_EC_CONTROL, version,
+			EC_CMD_PWM_SET_FAN_DUTY, &params,
+			version ? sizeof(params) :
+				  sizeof(struct ec_params_pwm_set_fan_duty_v0),
+			NULL, 0, origin);
+	fw_ec_cache_invalidate(data);
+	if (ret < 0)
+		return -EIO;
+
+	return 0;
+}
+
+// --- fan control write-behind ---
+static bool framework_fan_request_equal(const struct framework_fan_request *a,
+					const struct framework_fan_request *b)
+{
+	return a->mode == b->mode &&
+	       (a->mode == FW_FAN_MODE_AUTO || a->value == b->value);
+}
+
+static int framework_fan_send(struct framework_data *data, u8 idx,
+			      const struct framework_fan_request *req)
+{
+	u32 value = req->value;
+
+	switch (req->mode) {
+	case FW_FAN_MODE_AUTO:
+		return ec_set_auto_fan_ctrl(data, idx, req->origin);
+	case FW_FAN_MODE_DUTY:
+		return ec_set_fan_duty(data, idx, &value, req->origin);
+	case FW_FAN_MODE_RPM:
+		return ec_set_target_rpm(data, idx, &value, req->origin);
+	}
+
+	return -EINVAL;
+}
+
+static void framework_fan_work(struct work_struct *work)
+{
+	struct framework_fan *fan =
+		container_of(to_delayed_work(work), struct framework_fan, work);
+	struct framework_fan_request req;
+	int ret;
+
+	spin_lock(&fan->lock);
+	if (!fan->has_pending ||
+	    (fan->has_sent && framework_fan_request_equal(&fan->sent, &fan->pending))) {
+		fan->has_pending = false;
+		spin_unlock(&fan->lock);
+		return;
+	}
+	req = fan->pending;
+	fan->has_pending = false;
+	// Mark it as sent now, so that requests arriving while it's in
+	// flight are compared against it
+	fan->sent = req;
+	fan->has_sent = true;
+	spin_unlock(&fan->lock);
+
+	ret = framework_fan_send(fan->data, fan->idx, &req);
+
+	spin_lock(&fan->lock);
+	fan->error = ret;
+	fan->sent_at = jiffies;
+	// We don't know what the EC did, so don't skip a retry
+	if (ret < 0)
+		fan->has_sent = false;
+	spin_unlock(&fan->lock);
+}
+
+// Remember what the fan was last asked to do. Called with the fan lock held.
+static void framework_fan_record(struct framework_fan *fan,
+				 const struct framework_fan_request *req)
+{
+	fan->mode = req->mode;
+	if (req->mode == FW_FAN_MODE_DUTY) {
+		fan->duty = req->value;
+		fan->has_duty = true;
+	} else if (req->mode == FW_FAN_MODE_RPM) {
+		fan->rpm = req->value;
+	}
+}
+
+// Drop whatever the work still has to send, ahead of
+// framework_fan_send_now(). This waits for the work, so it must not be
+// called with the EC gate held.
+static void framework_fan_cancel(struct framework_data *data, u8 idx)
+{
+	struct framework_fan *fan = &data->fans[idx];
+
+	cancel_delayed_work_sync(&fan->work);
+
+	spin_lock(&fan->lock);
+	fan->has_pending = false;
+	spin_unlock(&fan->lock);
+}
+
+// Send a request right away instead of through the work, after
+// framework_fan_cancel()
+static int framework_fan_send_now(struct framework_data *data, u8 idx,
+				  const struct framework_fan_request *req)
+{
+	struct framework_fan *fan = &data->fans[idx];
+	int ret;
+
+	spin_lock(&fan->lock);
+	framework_fan_record(fan, req);
+	spin_unlock(&fan->lock);
+
+	ret = framework_fan_send(data, idx, req);
+
+	spin_lock(&fan->lock);
+	fan->sent = *req;
+	fan->has_sent = ret == 0;
+	fan->error = ret;
+	fan->sent_at = jiffies;
+	spin_unlock(&fan->lock);
+
+	return ret;
+}
+
+// Queue a control request, replacing any that hasn't been sent yet. Returns
+// immediately; the result is reported through pwmN_status.
+static void framework_fan_request(struct framework_data *data, u8 idx,
+				  enum framework_fan_mode mode, u32 value,
+				  const char *origin)
+{
+	struct framework_fan *fan = &data->fans[idx];
+	struct framework_fan_request req = {
+		.mode = mode,
+		.value = value,
+		.origin = origin,
+	};
+	unsigned long next, delay = 0;
+
+	spin_lock(&fan->lock);
+	framework_fan_record(fan, &req);
+	if (fan->has_pending) {
+		// Already scheduled, so the newest request wins
+		fan->pending = req;
+	} else if (!fan->has_sent || !framework_fan_request_equal(&fan->sent, &req)) {
+		fan->pending = req;
+		fan->has_pending = true;
+
+		next = fan->sent_at + msecs_to_jiffies(READ_ONCE(fan_write_interval));
+		if (fan->has_sent && time_before(jiffies, next))
+			delay = next - jiffies;
+
+		queue_delayed_work(fw_wq, &fan->work, delay);
+	}
+	spin_unlock(&fan->lock);
+}
+
+static void framework_fan_init(struct framework_data *data)
+{
+	for (size_t i = 0; i < EC_FAN_SPEED_ENTRIES; i++) {
+		struct framework_fan *fan = &data->fans[i];
+
+		fan->data = data;
+		fan->idx = i;
+		fan->average_interval = FW_AVERAGE_INTERVAL_DEFAULT;
+		spin_lock_init(&fan->lock);
+		INIT_DELAYED_WORK(&fan->work, framework_fan_work);
+	}
+
+	spin_lock_init(&data->power_lock);
+	data->power_average_interval = FW_AVERAGE_INTERVAL_DEFAULT;
+}
+
+// Send whatever is still pending before going away
+static void framework_fan_flush(struct framework_data *data)
+{
+	for (size_t i = 0; i < EC_FAN_SPEED_ENTRIES; i++)
+		flush_delayed_work(&data->fans[i].work);
+}
+
+static ssize_t fw_pwm_status_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct sensor_device_attribute *sen_attr = to_sensor_dev_attr(attr);
+	struct framework_data *data = dev_get_drvdata(dev);
+	struct framework_fan *fan = &data->fans[sen_attr->index];
+	int error;
+
+	spin_lock(&fan->lock);
+	error = fan->error;
+	spin_unlock(&fan->lock);
+
+	return sysfs_emit(buf, "%d\n", error);
+}
+
+static ssize_t fw_pwm_min_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%i\n", 0);
+}
+
+static ssize_t fw_pwm_max_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%i\n", 100);
+}
+
+// Count the fans the EC reports, and remember which ones are present
+static ssize_t ec_count_fans(struct framework_data *data, size_t *val)
+{
+	u16 fan;
+
+	*val = 0;
+	data->fan_mask = 0;
+
+	for (size_t i = 0; i < EC_FAN_SPEED_ENTRIES; i++) {
+		if (ec_get_fan_speed(data, i, &fan) < 0)
+			return -EIO;
+
+		if (fan != EC_FAN_SPEED_NOT_PRESENT) {
+			data->fan_mask |= BIT(i);
+			(*val)++;
+		}
+	}
+
+	return 0;
+}
+
+// --- framework_privacy ---
+static ssize_t ec_get_privacy(struct framework_data *data,
+			      struct ec_response_privacy_switches_check *resp,
+			      const char *origin)
+{
+	int ret;
+	if (!ec_device)
+		return -ENODEV;
+
+	ret = fw_ec_cmd_cached(data, 0, EC_CMD_PRIVACY_SWITCHES_CHECK_MODE, NULL,
+			       0, resp, sizeof(*resp), FW_CACHE_TTL_PRIVACY,
+			       origin);
+	if (ret < 0)
+		return -EIO;
+
+	return 0;
+}
+
+// Remember the new state, and tell anyone waiting on framework_privacy or
+// the input device if it changed
+static void framework_privacy_update(struct framework_data *data,
+				     const struct ec_response_privacy_switches_check *resp)
+{
+	struct framework_privacy *privacy = &data->privacy;
+	bool changed;
+
+	mutex_lock(&privacy->lock);
+	changed = privacy->state.microphone != resp->microphone ||
+		  privacy->state.camera != resp->camera;
+	changed = changed && privacy->valid;
+	privacy->valid = true;
+	privacy->state = *resp;
+	privacy->checked = jiffies;
+	if (changed && privacy->input) {
+		input_report_switch(privacy->input, SW_MUTE_DEVICE,
+				    !resp->microphone);
+		input_report_switch(privacy->input, SW_CAMERA_LENS_COVER,
+				    !resp->camera);
+		input_sync(privacy->input);
+	}
+	mutex_unlock(&privacy->lock);
+
+	if (changed)
+		sysfs_notify(&data->pdev->dev.kobj, NULL, "framework_privacy");
+}
+
+static void framework_privacy_refresh(struct framework_data *data,
+				      const char *origin)
+{
+	struct ec_response_privacy_switches_check resp;
+
+	if (ec_get_privacy(data, &resp, origin) == 0)
+		framework_privacy_update(data, &resp);
+}
+
+static void framework_privacy_work(struct work_struct *work)
+{
+	struct framework_privacy *privacy =
+		container_of(work, struct framework_privacy, work);
+
+	framework_privacy_refresh(container_of(privacy, struct framework_data, privacy),
+				  "ec_event");
+}
+
+static void framework_privacy_cancel(void *_data)
+{
+	struct framework_data *data = _data;
+
+	cancel_work_sync(&data->privacy.work);
+}
+
+static void framework_privacy_init(struct framework_data *data)
+{
+	struct framework_privacy *privacy = &data->privacy;
+
+	mutex_init(&privacy->lock);
+	INIT_WORK(&privacy->work, framework_privacy_work);
+}
+
+// Register the switches as an input device, if the EC supports them
+static int framework_privacy_probe(struct framework_data *data)
+{
+	struct device *dev = &data->pdev->dev;
+	struct framework_privacy *privacy = &data->privacy;
+	struct input_dev *input;
+	int ret;
+
+	if (ec_get_privacy(data, &privacy->state, "setup") < 0)
+		return 0;
+
+	privacy->valid = true;
+	privacy->checked = jiffies;
+
+	input = devm_input_allocate_device(dev);
+	if (!input)
+		return -ENOMEM;
+
+	input->name = "Framework Laptop Privacy Switches";
+	input->phys = DRV_NAME "/input0";
+	input->id.bustype = BUS_HOST;
+	input_set_capability(input, EV_SW, SW_MUTE_DEVICE);
+	input_set_capability(input, EV_SW, SW_CAMERA_LENS_COVER);
+
+	ret = input_register_device(input);
+	if (ret)
+		return ret;
+
+	input_report_switch(input, SW_MUTE_DEVICE, !privacy->state.microphone);
+	input_report_switch(input, SW_CAMERA_LENS_COVER, !privacy->state.camera);
+	input_sync(input);
+
+	// The work uses the input device, so it must be cancelled first
+	ret = devm_add_action_or_reset(dev, framework_privacy_cancel, data);
+	if (ret)
+		return ret;
+
+	privacy->input = input;
+	return 0;
+}
+
+static ssize_t framework_privacy_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
+{
+	struct framework_data *data = dev_get_drvdata(dev);
+	struct framework_privacy *privacy = &data->privacy;
+	struct ec_response_privacy_switches_check resp;
+	bool valid;
+
+	// EC events and the poller's rechecks keep the state current. Without
+	// them, or if nothing has checked for a while (the poller backs off on
+	// an idle machine), ask the EC.
+	if (!privacy->input || !READ_ONCE(data->hwmon_dev) ||
+	    time_after(jiffies, READ_ONCE(privacy->checked) +
+				msecs_to_jiffies(FW_PRIVACY_RECHECK_INTERVAL)))
+		framework_privacy_refresh(data, "framework_privacy");
+
+	mutex_lock(&privacy->lock);
+	valid = privacy->valid;
+	resp = privacy->state;
+	mutex_unlock(&privacy->lock);
+
+	if (!valid)
+		return -EIO;
+
+	// Output following dell-privacy's format
+	return sysfs_emit(buf, "[Microphone] [%s]\n[Camera] [%s]\n",
+			  resp.microphone ? "unmuted" : "muted",
+			  resp.camera ? "unmuted" : "muted");
+}
+
+// --- fan curve ---
+static const struct framework_curve_point fw_curve_default[FW_CURVE_POINTS] = {
+	{ 40000, 20 },
+	{ 60000, 40 },
+	{ 75000, 70 },
+	{ 85000, 100 },
+};
+
+static void framework_curve_init(struct framework_data *data)
+{
+	mutex_init(&data->curve_lock);
+
+	for (size_t i = 0; i < EC_FAN_SPEED_ENTRIES; i++) {
+		struct framework_fan_curve *curve = &data->curves[i];
+
+		memcpy(curve->points, fw_curve_default, sizeof(curve->points));
+		curve->hyst = 2000;
+		curve->duty = -1;
+	}
+}
+
+// The hottest of the channels this curve follows, in millidegrees Celsius
+static bool framework_curve_temp(struct framework_data *data,
+				 const struct framework_snapshot *snap,
+				 const struct framework_fan_curve *curve,
+				 long *val)
+{
+	unsigned long channels = curve->channels ?: data->temp_mask;
+	bool found = false;
+	size_t i;
+
+	for_each_set_bit(i, &channels, EC_TEMP_SENSOR_ENTRIES) {
+		u8 temp = snap->temps[i];
+		long mc;
+
+		if (temp >= EC_TEMP_SENSOR_NOT_CALIBRATED)
+			continue;
+
+		mc = kelvin_to_millicelsius(temp + EC_TEMP_SENSOR_OFFSET);
+		if (!found || mc > *val)
+			*val = mc;
+		found = true;
+	}
+
+	return found;
+}
+
+// Interpolate linearly between the points; fw_curve_point_temp_store() keeps
+// them sorted by temperature
+static int framework_curve_duty(const struct framework_fan_curve *curve,
+				long temp)
+{
+	const struct framework_curve_point *p = curve->points;
+
+	if (temp <= p[0].temp)
+		return p[0].pwm;
+
+	for (size_t i = 1; i < FW_CURVE_POINTS; i++) {
+		if (temp >= p[i].temp)
+			continue;
+
+		return p[i - 1].pwm + (p[i].pwm - p[i - 1].pwm) *
+			(temp - p[i - 1].temp) / (p[i].temp - p[i - 1].temp);
+	}
+
+	return p[FW_CURVE_POINTS - 1].pwm;
+}
+
+static void framework_curve_eval(struct framework_data *data,
+				 const struct framework_snapshot *snap)
+{
+	if (snap->status < 0)
+		return;
+
+	mutex_lock(&data->curve_lock);
+	for (size_t i = 0; i < EC_FAN_SPEED_ENTRIES; i++) {
+		struct framework_fan_curve *curve = &data->curves[i];
+		long temp;
+		int duty;
+
+		if (!(data->fan_mask & BIT(i)) || !curve->enabled)
+			continue;
+
+		if (framework_curve_temp(data, snap, curve, &temp)) {
+			// Only follow a falling temperature once it has
+			// dropped by more than the hysteresis
+			if (curve->duty >= 0 && temp < curve->ref_temp &&
+			    curve->ref_temp - temp <= curve->hyst)
+				temp = curve->ref_temp;
+			else
+				curve->ref_temp = temp;
+
+			duty = framework_curve_duty(curve, temp);
+		} else {
+			// No usable sensor, so be safe
+			duty = curve->points[FW_CURVE_POINTS - 1].pwm;
+		}
+
+		if (curve->ramp && curve->duty >= 0) {
+			unsigned int elapsed =
+				jiffies_to_msecs(jiffies - curve->evaluated_at);
+			int step = max_t(int, 1, curve->ramp * elapsed / 1000);
+
+			duty = clamp(duty, curve->duty - step, curve->duty + step);
+		}
+
+		curve->duty = duty;
+		curve->evaluated_at = jiffies;
+		framework_fan_request(data, i, FW_FAN_MODE_DUTY, duty, "fan_curve");
+	}
+	mutex_unlock(&data->curve_lock);
+}
+
+// Switch a fan between the curve, EC automatic control and manual control.
+// Manual requests are sent under the curve lock so that a concurrent
+// evaluation can't override them.
+static void framework_curve_select(struct framework_data *data, u8 idx,
+				   bool enable, enum framework_fan_mode mode,
+				   u32 value, const char *origin)
+{
+	struct framework_fan_curve *curve = &data->curves[idx];
+
+	mutex_lock(&data->curve_lock);
+	curve->enabled = enable;
+	curve->duty = -1;
+	if (!enable)
+		framework_fan_request(data, idx, mode, value, origin);
+	mutex_unlock(&data->curve_lock);
+
+	// Evaluate right away rather than at the next poll
+	if (enable)
+		framework_poll_kick(data, 0);
+}
+
+// Hand fans that were following a curve back to the EC
+static void framework_curve_stop(struct framework_data *data)
+{
+	mutex_lock(&data->curve_lock);
+	for (size_t i = 0; i < EC_FAN_SPEED_ENTRIES; i++) {
+		if (!data->curves[i].enabled)
+			continue;
+
+		data->curves[i].enabled = false;
+		framework_fan_request(data, i, FW_FAN_MODE_AUTO, 0, "remove");
+	}
+	mutex_unlock(&data->curve_lock);
+}
+
+static ssize_t fw_curve_point_temp_show(struct device *dev,
+					struct device_attribute *attr, char *buf)
+{
+	struct sensor_device_attribute_2 *sen_attr = to_sensor_dev_attr_2(attr);
+	struct framework_data *data = dev_get_drvdata(dev);
+	long temp;
+
+	mutex_lock(&data->curve_lock);
+	temp = data->curves[sen_attr->nr].points[sen_attr->index].temp;
+	mutex_unlock(&data->curve_lock);
+
+	return sysfs_emit(buf, "%ld\n", temp);
+}
+
+static ssize_t fw_curve_point_temp_store(struct device *dev,
+					 struct device_attribute *attr,
+					 const char *buf, size_t count)
+{
+	struct sensor_device_attribute_2 *sen_attr = to_sensor_dev_attr_2(attr);
+	struct framework_data *data = dev_get_drvdata(dev);
+	struct framework_curve_point *points;
+	int idx = sen_attr->index;
+	long temp;
+	int ret;
+
+	ret = kstrtol(buf, 10, &temp);
+	if (ret)
+		return ret;
+
+	temp = clamp_val(temp, 0, FW_CURVE_TEMP_MAX);
+
+	// framework_curve_duty() needs the points in increasing order, so
+	// don't let a point move past its neighbours
+	mutex_lock(&data->curve_lock);
+	points = data->curves[sen_attr->nr].points;
+	if ((idx > 0 && temp <= points[idx - 1].temp) ||
+	    (idx < FW_CURVE_POINTS - 1 && temp >= points[idx + 1].temp)) {
+		mutex_unlock(&data->curve_lock);
+		return -EINVAL;
+	}
+	points[idx].temp = temp;
+	mutex_unlock(&data->curve_lock);
+
+	return count;
+}
+
+static ssize_t fw_curve_point_pwm_show(struct device *dev,
+				       struct device_attribute *attr, char *buf)
+{
+	struct sensor_device_attribute_2 *sen_attr = to_sensor_dev_attr_2(attr);
+	struct framework_data *data = dev_get_drvdata(dev);
+	u8 pwm;
+
+	mutex_lock(&data->curve_lock);
+	pwm = data->curves[sen_attr->nr].points[sen_attr->index].pwm;
+	mutex_unlock(&data->curve_lock);
+
+	return sysfs_emit(buf, "%u\n", pwm);
+}
+
+static ssize_t fw_curve_point_pwm_store(struct device *dev,
+					struct device_attribute *attr,
+					const char *buf, size_t count)
+{
+	struct sensor_device_attribute_2 *sen_attr = to_sensor_dev_attr_2(attr);
+	struct framework_data *data = dev_get_drvdata(dev);
+	u8 pwm;
+	int ret;
+
+	ret = kstrtou8(buf, 10, &pwm);
+	if (ret)
+		return ret;
+	if (pwm > 100)
+		return -EINVAL;
+
+	mutex_lock(&data->curve_lock);
+	data->curves[sen_attr->nr].points[sen_attr->index].pwm = pwm;
+	mutex_unlock(&data->curve_lock);
+
+	return count;
+}
+
+// Bit 0 is temp1
+static ssize_t fw_curve_channels_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
+{
+	struct sensor_device_attribute_2 *sen_attr = to_sensor_dev_attr_2(attr);
+	struct framework_data *data = dev_get_drvdata(dev);
+	unsigned long channels;
+
+	mutex_lock(&data->curve_lock);
+	channels = data->curves[sen_attr->nr].channels;
+	mutex_unlock(&data->curve_lock);
+
+	return sysfs_emit(buf, "%lu\n", channels);
+}
+
+static ssize_t fw_curve_channels_store(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t count)
+{
+	struct sensor_device_attribute_2 *sen_attr = to_sensor_dev_attr_2(attr);
+	struct framework_data *data = dev_get_drvdata(dev);
+	unsigned long channels;
+	int ret;
+
+	ret = kstrtoul(buf, 10, &channels);
+	if (ret)
+		return ret;
+	if (channels & ~data->temp_mask)
+		return -EINVAL;
+
+	mutex_lock(&data->curve_lock);
+	data->curves[sen_attr->nr].channels = channels;
+	mutex_unlock(&data->curve_lock);
+
+	return count;
+}
+
+static ssize_t fw_curve_hyst_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct sensor_device_attribute_2 *sen_attr = to_sensor_dev_attr_2(attr);
+	struct framework_data *data = dev_get_drvdata(dev);
+	long hyst;
+
+	mutex_lock(&data->curve_lock);
+	hyst = data->curves[sen_attr->nr].hyst;
+	mutex_unlock(&data->curve_lock);
+
+	return sysfs_emit(buf, "%ld\n", hyst);
+}
+
+static ssize_t fw_curve_hyst_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	struct sensor_device_attribute_2 *sen_attr = to_sensor_dev_attr_2(attr);
+	struct framework_data *data = dev_get_drvdata(dev);
+	long hyst;
+	int ret;
+
+	ret = kstrtol(buf, 10, &hyst);
+	if (ret)
+		return ret;
+
+	mutex_lock(&data->curve_lock);
+	data->curves[sen_attr->nr].hyst = clamp_val(hyst, 0, FW_CURVE_TEMP_MAX);
+	mutex_unlock(&data->curve_lock);
+
+	return count;
+}
+
+static ssize_t fw_curve_ramp_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct sensor_device_attribute_2 *sen_attr = to_sensor_dev_attr_2(attr);
+	struct framework_data *data = dev_get_drvdata(dev);
+	unsigned int ramp;
+
+	mutex_lock(&data->curve_lock);
+	ramp = data->curves[sen_attr->nr].ramp;
+	mutex_unlock(&data->curve_lock);
+
+	return sysfs_emit(buf, "%u\n", ramp);
+}
+
+static ssize_t fw_curve_ramp_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	struct sensor_device_attribute_2 *sen_attr = to_sensor_dev_attr_2(attr);
+	struct framework_data *data = dev_get_drvdata(dev);
+	unsigned int ramp;
+	int ret;
+
+	ret = kstrtouint(buf, 10, &ramp);
+	if (ret)
+		return ret;
+	if (ramp > 100)
+		return -EINVAL;
+
+	mutex_lock(&data->curve_lock);
+	data->curves[sen_attr->nr].ramp = ramp;
+	mutex_unlock(&data->curve_lock);
+
+	return count;
+}
+
+// --- cooling devices ---
+// Each present fan is a cooling device whose state is the duty in percent.
+// State 0 hands the fan back to the EC, which is what a governor asks for
+// while the zone is below its trips, so the EC's own protection stays on.
+static int fw_cooling_get_max_state(struct thermal_cooling_device *cdev,
+				    unsigned long *state)
+{
+	*state = 100;
+	return 0;
+}
+
+// The last duty requested, or 0 if the fan is under the EC's control
+static int fw_cooling_get_cur_state(struct thermal_cooling_device *cdev,
+				    unsigned long *state)
+{
+	struct framework_fan *fan = cdev->devdata;
+	struct framework_fan_request req = { .mode = FW_FAN_MODE_AUTO };
+
+	spin_lock(&fan->lock);
+	if (fan->has_pending)
+		req = fan->pending;
+	else if (fan->has_sent)
+		req = fan->sent;
+	spin_unlock(&fan->lock);
+
+	*state = req.mode == FW_FAN_MODE_DUTY ? req.value : 0;
+	return 0;
+}
+
+static int fw_cooling_set_cur_state(struct thermal_cooling_device *cdev,
+				    unsigned long state)
+{
+	struct framework_fan *fan = cdev->devdata;
+
+	if (state > 100)
+		return -EINVAL;
+
+	if (state == 0 && fw_fan_cmd_version(fan->data, FW_CAP_AUTO_FAN) >= 0)
+		framework_curve_select(fan->data, fan->idx, false,
+				       FW_FAN_MODE_AUTO, 0, "cooling_device");
+	else
+		framework_curve_select(fan->data, fan->idx, false,
+				       FW_FAN_MODE_DUTY, state, "cooling_device");
+	return 0;
+}
+
+static const struct thermal_cooling_device_ops fw_cooling_ops = {
+	.get_max_state = fw_cooling_get_max_state,
+	.get_cur_state = fw_cooling_get_cur_state,
+	.set_cur_state = fw_cooling_set_cur_state,
+};
+
+// Without the thermal framework the fans are still usable through hwmon,
+// so failures here aren't fatal
+static void framework_cooling_register(struct framework_data *data)
+{
+	struct device *dev = &data->pdev->dev;
+
+	if (fw_fan_cmd_version(data, FW_CAP_FAN_DUTY) < 0)
+		return;
+
+	for (size_t i = 0; i < EC_FAN_SPEED_ENTRIES; i++) {
+		struct framework_fan *fan = &data->fans[i];
+		struct thermal_cooling_device *cdev;
+
+		if (!(data->fan_mask & BIT(i)))
+			continue;
+
+		cdev = thermal_cooling_device_register("Fan", fan, &fw_cooling_ops);
+		if (IS_ERR(cdev)) {
+			dev_err(dev, DRV_NAME ": failed to register fan %zu as a cooling device.\n", i + 1);
+			continue;
+		}
+		fan->cdev = cdev;
+	}
+}
+
+static void framework_cooling_unregister(struct framework_data *data)
+{
+	for (size_t i = 0; i < EC_FAN_SPEED_ENTRIES; i++) {
+		if (!data->fans[i].cdev)
+			continue;
+
+		thermal_cooling_device_unregister(data->fans[i].cdev);
+		data->fans[i].cdev = NULL;
+	}
+}
+
+// --- fan history ---
+static void framework_fan_history(struct framework_data *data,
+				  const struct framework_snapshot *snap)
+{
+	if (snap->status < 0)
+		return;
+
+	for (size_t i = 0; i < EC_FAN_SPEED_ENTRIES; i++) {
+		struct framework_fan *fan = &data->fans[i];
+		u16 speed = snap->fans[i];
+		unsigned int dt;
+
+		if (!(data->fan_mask & BIT(i)) || speed == EC_FAN_SPEED_NOT_PRESENT)
+			continue;
+		if (speed == EC_FAN_SPEED_STALLED)
+			speed = 0;
+
+		spin_lock(&fan->lock);
+		if (!fan->has_history) {
+			fan->has_history = true;
+			fan->lowest = speed;
+			fan->highest = speed;
+			fan->average = speed * 1000LL;
+		} else {
+			fan->lowest = min(fan->lowest, speed);
+			fan->highest = max(fan->highest, speed);
+
+			dt = min_t(u64, div_u64(snap->timestamp - fan->average_at,
+						NSEC_PER_MSEC),
+				   fan->average_interval);
+			fan->average += div_s64((speed * 1000LL - fan->average) * dt,
+						fan->average_interval);
+		}
+		fan->average_at = snap->timestamp;
+		spin_unlock(&fan->lock);
+	}
+}
+
+static ssize_t fw_fan_lowest_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct sensor_device_attribute *sen_attr = to_sensor_dev_attr(attr);
+	struct framework_data *data = dev_get_drvdata(dev);
+	struct framework_fan *fan = &data->fans[sen_attr->index];
+	bool valid;
+	u16 lowest;
+
+	spin_lock(&fan->lock);
+	valid = fan->has_history;
+	lowest = fan->lowest;
+	spin_unlock(&fan->lock);
+
+	if (!valid)
+		return -ENODATA;
+
+	return sysfs_emit(buf, "%u\n", lowest);
+}
+
+static ssize_t fw_fan_highest_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct sensor_device_attribute *sen_attr = to_sensor_dev_attr(attr);
+	struct framework_data *data = dev_get_drvdata(dev);
+	struct framework_fan *fan = &data->fans[sen_attr->index];
+	bool valid;
+	u16 highest;
+
+	spin_lock(&fan->lock);
+	valid = fan->has_history;
+	highest = fan->highest;
+	spin_unlock(&fan->lock);
+
+	if (!valid)
+		return -ENODATA;
+
+	return sysfs_emit(buf, "%u\n", highest);
+}
+
+static ssize_t fw_fan_average_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct sensor_device_attribute *sen_attr = to_sensor_dev_attr(attr);
+	struct framework_data *data = dev_get_drvdata(dev);
+	struct framework_fan *fan = &data->fans[sen_attr->index];
+	bool valid;
+	s64 average;
+
+	spin_lock(&fan->lock);
+	valid = fan->has_history;
+	average = fan->average;
+	spin_unlock(&fan->lock);
+
+	if (!valid)
+		return -ENODATA;
+
+	return sysfs_emit(buf, "%lld\n", div_s64(average + 500, 1000));
+}
+
+static ssize_t fw_fan_average_interval_show(struct device *dev,
+					    struct device_attribute *attr,
+					    char *buf)
+{
+	struct sensor_device_attribute *sen_attr = to_sensor_dev_attr(attr);
+	struct framework_data *data = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%u\n",
+			  READ_ONCE(data->fans[sen_attr->index].average_interval));
+}
+
+static ssize_t fw_fan_average_interval_store(struct device *dev,
+					     struct device_attribute *attr,
+					     const char *buf, size_t count)
+{
+	struct sensor_device_attribute *sen_attr = to_sensor_dev_attr(attr);
+	struct framework_data *data = dev_get_drvdata(dev);
+	struct framework_fan *fan = &data->fans[sen_attr->index];
+	unsigned int interval;
+	int ret;
+
+	ret = kstrtouint(buf, 10, &interval);
+	if (ret)
+		return ret;
+
+	spin_lock(&fan->lock);
+	fan->average_interval = clamp_val(interval, 1, FW_AVERAGE_INTERVAL_MAX);
+	spin_unlock(&fan->lock);
+
+	return count;
+}
+
+// Any write starts a new interval
+static ssize_t fw_fan_reset_history_store(struct device *dev,
+					  struct device_attribute *attr,
+					  const char *buf, size_t count)
+{
+	struct sensor_device_attribute *sen_attr = to_sensor_dev_attr(attr);
+	struct framework_data *data = dev_get_drvdata(dev);
+	struct framework_fan *fan = &data->fans[sen_attr->index];
+
+	spin_lock(&fan->lock);
+	fan->has_history = false;
+	spin_unlock(&fan->lock);
+
+	return count;
+}
+
+// --- system power ---
+// Total system power in uW. EC_CMD_POWER_INFO measures it directly; without
+// it, the battery discharge rate is only the whole story while off AC.
+static int fw_system_power(const struct framework_snapshot *snap, long *uw)
+{
+	const struct framework_memmap_battery *battery = &snap->battery;
+
+	if (snap->power_status == 0) {
+		*uw = (long)snap->power.voltage_system * snap->power.current_system;
+		return 0;
+	}
+
+	if (snap->battery_status < 0)
+		return snap->battery_status;
+
+	if (!(battery->flag & EC_BATT_FLAG_BATT_PRESENT) ||
+	    !(battery->flag & EC_BATT_FLAG_DISCHARGING) ||
+	    (battery->flag & EC_BATT_FLAG_AC_PRESENT))
+		return -ENODATA;
+
+	*uw = (long)battery->volt * battery->rate;
+	return 0;
+}
+
+// Current drawn from the charger in mA, which needs EC_CMD_POWER_INFO
+static int fw_charger_current(const struct framework_snapshot *snap, long *ma)
+{
+	if (snap->power_status < 0)
+		return snap->power_status;
+
+	if (snap->battery_status < 0 ||
+	    !(snap->battery.flag & EC_BATT_FLAG_AC_PRESENT))
+		return -ENODATA;
+
+	*ma = snap->power.current_system;
+	return 0;
+}
+
+static void framework_power_history(struct framework_data *data,
+				    const struct framework_snapshot *snap)
+{
+	unsigned int dt;
+	long uw;
+
+	spin_lock(&data->power_lock);
+	// Start over after a gap, rather than average across it
+	if (fw_system_power(snap, &uw) < 0) {
+		data->power_has_average = false;
+	} else if (!data->power_has_average) {
+		data->power_has_average = true;
+		data->power_average = uw;
+	} else {
+		dt = min_t(u64, div_u64(snap->timestamp - data->power_average_at,
+					NSEC_PER_MSEC),
+			   data->power_average_interval);
+		data->power_average += div_s64((uw - data->power_average) * dt,
+					       data->power_average_interval);
+	}
+	data->power_average_at = snap->timestamp;
+	spin_unlock(&data->power_lock);
+}
+
+// --- telemetry ring ---
+static void framework_ring_free(struct kref *ref)
+{
+	struct framework_ring *ring = container_of(ref, struct framework_ring, ref);
+
+	vfree(ring->base);
+	kfree(ring);
+}
+
+// Single producer: only the poller writes records
+static void framework_ring_push(struct framework_data *data,
+				const struct framework_snapshot *snap)
+{
+	struct framework_ring *ring = data->ring;
+	struct framework_ring_record *rec;
+	u64 head;
+
+	if (!ring)
+		return;
+
+	head = ring->header->head;
+	rec = &ring->records[head % FW_RING_RECORDS];
+
+	// Readers check head after reading a record to see whether it was
+	// overwritten, so the last head update must land before we touch the
+	// slot it frees
+	smp_wmb();
+
+	memset(rec, 0, sizeof(*rec));
+	rec->timestamp_ns = snap->timestamp;
+	if (snap->status == 0) {
+		memcpy(rec->temps, snap->temps, sizeof(rec->temps));
+		memcpy(rec->fans, snap->fans, sizeof(rec->fans));
+		rec->flags |= FW_RING_THERMAL_VALID;
+	}
+	if (snap->battery_status == 0) {
+		rec->batt_volt = snap->battery.volt;
+		rec->batt_rate = snap->battery.rate;
+		rec->batt_cap = snap->battery.cap;
+		rec->batt_flag = snap->battery.flag;
+		rec->flags |= FW_RING_BATTERY_VALID;
+	}
+
+	smp_store_release(&ring->header->head, head + 1);
+}
+
+static int fw_ring_open(struct inode *inode, struct file *file)
+{
+	struct framework_data *data = container_of(file->private_data,
+						   struct framework_data,
+						   ring_misc);
+
+	kref_get(&data->ring->ref);
+	atomic_inc(&data->ring->users);
+	file->private_data = data->ring;
+	// Move the pending poll onto the timer that isn't deferred
+	framework_poll_kick(data, framework_poll_delay(data));
+	framework_poll_touch(data);
+
+	return 0;
+}
+
+static int fw_ring_release(struct inode *inode, struct file *file)
+{
+	struct framework_ring *ring = file->private_data;
+
+	atomic_dec(&ring->users);
+	kref_put(&ring->ref, framework_ring_free);
+	return 0;
+}
+
+static int fw_ring_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct framework_ring *ring = file->private_data;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_clear(vma, VM_MAYWRITE);
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+	return remap_vmalloc_range(vma, ring->base, vma->vm_pgoff);
+}
+
+static const struct file_operations fw_ring_fops = {
+	.owner = THIS_MODULE,
+	.open = fw_ring_open,
+	.release = fw_ring_release,
+	.mmap = fw_ring_mmap,
+	.llseek = noop_llseek,
+};
+
+// Not having the ring isn't fatal; everything else still works
+static void framework_ring_register(struct framework_data *data)
+{
+	struct device *dev = &data->pdev->dev;
+	size_t records = PAGE_ALIGN(FW_RING_RECORDS *
+				    sizeof(struct framework_ring_record));
+	struct framework_ring *ring;
+	int ret;
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		return;
+
+	ring->base = vmalloc_user(PAGE_SIZE + records);
+	if (!ring->base) {
+		kfree(ring);
+		return;
+	}
+
+	kref_init(&ring->ref);
+	ring->header = ring->base;
+	ring->records = ring->base + PAGE_SIZE;
+	ring->header->magic = FW_RING_MAGIC;
+	ring->header->version = FW_RING_VERSION;
+	ring->header->header_size = PAGE_SIZE;
+	ring->header->record_size = sizeof(struct framework_ring_record);
+	ring->header->nr_records = FW_RING_RECORDS;
+	data->ring = ring;
+
+	data->ring_misc.minor = MISC_DYNAMIC_MINOR;
+	data->ring_misc.name = DRV_NAME "_telemetry";
+	data->ring_misc.fops = &fw_ring_fops;
+	data->ring_misc.mode = 0444;
+	data->ring_misc.parent = dev;
+	ret = misc_register(&data->ring_misc);
+	if (ret) {
+		dev_err(dev, DRV_NAME ": failed to register telemetry device.\n");
+		data->ring = NULL;
+		kref_put(&ring->ref, framework_ring_free);
+	}
+}
+
+// --- adaptive poll interval ---
+static bool framework_poll_busy(struct framework_data *data,
+				const struct framework_snapshot *prev,
+				const struct framework_snapshot *cur)
+{
+	// Fan curves and telemetry readers need every sample
+	if (framework_poll_timely(data))
+		return true;
+	if (time_before(jiffies, READ_ONCE(data->last_read) +
+			msecs_to_jiffies(FW_POLL_READER_TIMEOUT)))
+		return true;
+
+	if (prev->status != cur->status)
+		return true;
+	if (cur->status < 0)
+		return false;
+
+	for (size_t i = 0; i < EC_FAN_SPEED_ENTRIES; i++) {
+		if (abs((int)cur->fans[i] - (int)prev->fans[i]) >= FW_POLL_RPM_DELTA)
+			return true;
+	}
+	for (size_t i = 0; i < EC_TEMP_SENSOR_ENTRIES; i++) {
+		if (abs((int)cur->temps[i] - (int)prev->temps[i]) >= FW_POLL_TEMP_DELTA)
+			return true;
+	}
+
+	return false;
+}
+
+// Double the interval every time nothing happens, and drop straight back to
+// poll_interval when something does
+static void framework_poll_adapt(struct framework_data *data,
+				 const struct framework_snapshot *prev,
+				 const struct framework_snapshot *cur)
+{
+	unsigned int base = READ_ONCE(data->poll_interval);
+	unsigned int limit = clamp_val(READ_ONCE(poll_interval_max), base,
+				       FW_POLL_INTERVAL_MAX);
+	unsigned int interval = READ_ONCE(data->poll_effective);
+
+	if (framework_poll_busy(data, prev, cur))
+		interval = base;
+	else
+		interval = min(interval * 2, limit);
+
+	WRITE_ONCE(data->poll_effective, interval);
+}
+
+// --- EC events ---
+static const char * const fw_event_names[FW_EVENT_COUNT] = {
+	[FW_EVENT_AC] = "ac",
+	[FW_EVENT_BATTERY] = "battery",
+	[FW_EVENT_BATTERY_CRITICAL] = "battery_critical",
+	[FW_EVENT_CHARGE_STOPPED] = "charge_stopped",
+	[FW_EVENT_THERMAL] = "thermal",
+	[FW_EVENT_THROTTLE_START] = "throttle_start",
+	[FW_EVENT_THROTTLE_STOP] = "throttle_stop",
+};
+
+// Host events behind each event. The EC doesn't have one for reaching the
+// charge limit, that only shows up in the memory map.
+static const u32 fw_event_host_masks[FW_EVENT_COUNT] = {
+	[FW_EVENT_AC] = EC_HOST_EVENT_MASK(EC_HOST_EVENT_AC_CONNECTED) |
+			EC_HOST_EVENT_MASK(EC_HOST_EVENT_AC_DISCONNECTED),
+	[FW_EVENT_BATTERY] = EC_HOST_EVENT_MASK(EC_HOST_EVENT_BATTERY) |
+			     EC_HOST_EVENT_MASK(EC_HOST_EVENT_BATTERY_LOW) |
+			     EC_HOST_EVENT_MASK(EC_HOST_EVENT_BATTERY_STATUS),
+	[FW_EVENT_BATTERY_CRITICAL] =
+		EC_HOST_EVENT_MASK(EC_HOST_EVENT_BATTERY_CRITICAL) |
+		EC_HOST_EVENT_MASK(EC_HOST_EVENT_BATTERY_SHUTDOWN),
+	[FW_EVENT_THERMAL] = EC_HOST_EVENT_MASK(EC_HOST_EVENT_THERMAL_THRESHOLD) |
+			     EC_HOST_EVENT_MASK(EC_HOST_EVENT_THERMAL) |
+			     EC_HOST_EVENT_MASK(EC_HOST_EVENT_THERMAL_SHUTDOWN),
+	[FW_EVENT_THROTTLE_START] = EC_HOST_EVENT_MASK(EC_HOST_EVENT_THROTTLE_START),
+	[FW_EVENT_THROTTLE_STOP] = EC_HOST_EVENT_MASK(EC_HOST_EVENT_THROTTLE_STOP),
+};
+
+// The poller sees these in the battery flags, so while it's running they're
+// only counted from there to avoid counting them twice
+#define FW_EVENTS_MEMMAP (BIT(FW_EVENT_AC) | BIT(FW_EVENT_BATTERY) | \
+			  BIT(FW_EVENT_BATTERY_CRITICAL))
+
+static void framework_events_record(struct framework_data *data,
+				    unsigned long events)
+{
+	unsigned int e;
+
+	if (!events)
+		return;
+
+	spin_lock(&data->events_lock);
+	for_each_set_bit(e, &events, FW_EVENT_COUNT)
+		data->event_counts[e]++;
+	data->events_pending |= events;
+	spin_unlock(&data->events_lock);
+
+	queue_work(fw_wq, &data->events_work);
+}
+
+// Wake up poll()ers of ec_events and send a uevent for each event
+static void framework_events_work(struct work_struct *work)
+{
+	struct framework_data *data =
+		container_of(work, struct framework_data, events_work);
+	struct kobject *kobj = &data->pdev->dev.kobj;
+	char event[32];
+	char *envp[] = { event, NULL };
+	unsigned long events;
+	unsigned int e;
+
+	spin_lock(&data->events_lock);
+	events = data->events_pending;
+	data->events_pending = 0;
+	spin_unlock(&data->events_lock);
+
+	sysfs_notify(kobj, NULL, "ec_events");
+
+	for_each_set_bit(e, &events, FW_EVENT_COUNT) {
+		snprintf(event, sizeof(event), "FRAMEWORK_EC_EVENT=%s",
+			 fw_event_names[e]);
+		kobject_uevent_env(kobj, KOBJ_CHANGE, envp);
+	}
+}
+
+static void framework_events_cancel(void *_data)
+{
+	struct framework_data *data = _data;
+
+	cancel_work_sync(&data->events_work);
+}
+
+// Look for AC, charging and critical level changes in the battery flags
+static void framework_notify_battery(struct framework_data *data,
+				     const struct framework_snapshot *prev,
+				     const struct framework_snapshot *cur)
+{
+	u8 old, new, changed;
+	unsigned long events = 0;
+
+	if (prev->battery_status < 0 || cur->battery_status < 0)
+		return;
+
+	old = prev->battery.flag;
+	new = cur->battery.flag;
+	changed = old ^ new;
+
+	if (changed & EC_BATT_FLAG_AC_PRESENT)
+		events |= BIT(FW_EVENT_AC);
+	if (changed & (EC_BATT_FLAG_CHARGING | EC_BATT_FLAG_DISCHARGING |
+		       EC_BATT_FLAG_BATT_PRESENT))
+		events |= BIT(FW_EVENT_BATTERY);
+	if (new & changed & EC_BATT_FLAG_LEVEL_CRITICAL)
+		events |= BIT(FW_EVENT_BATTERY_CRITICAL);
+	// Stopped charging while still on AC: full, or at the charge limit
+	if ((old & changed & EC_BATT_FLAG_CHARGING) &&
+	    (old & new & EC_BATT_FLAG_AC_PRESENT))
+		events |= BIT(FW_EVENT_CHARGE_STOPPED);
+
+	if (!events)
+		return;
+
+	// The charge limit may have been changed by the EC itself
+	fw_ec_cache_invalidate(data);
+	framework_events_record(data, events);
+}
+
+// Translate host events from the EC notifier
+static void framework_events_host(struct framework_data *data, u32 host)
+{
+	unsigned long events = 0;
+
+	for (size_t e = 0; e < FW_EVENT_COUNT; e++) {
+		if (host & fw_event_host_masks[e])
+			events |= BIT(e);
+	}
+
+	// Let the poller pick the flag changes up right away
+	if (READ_ONCE(data->hwmon_dev) && (events & FW_EVENTS_MEMMAP)) {
+		events &= ~FW_EVENTS_MEMMAP;
+		framework_poll_kick(data, 0);
+	}
+
+	framework_events_record(data, events);
+}
+
+// The number of times each event has happened, one name=count per line
+static ssize_t ec_events_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct framework_data *data = dev_get_drvdata(dev);
+	u32 counts[FW_EVENT_COUNT];
+	int len = 0;
+
+	spin_lock(&data->events_lock);
+	memcpy(counts, data->event_counts, sizeof(counts));
+	spin_unlock(&data->events_lock);
+
+	for (size_t e = 0; e < FW_EVENT_COUNT; e++)
+		len += sysfs_emit_at(buf, len, "%s=%u\n", fw_event_names[e],
+				     counts[e]);
+
+	return len;
+}
+
+static DEVICE_ATTR_RO(ec_events);
+
+// --- memmap poller work ---
+// Tell anyone waiting on fanN_alarm or fanN_fault that the fan stalled,
+// recovered, went missing or came back
+static void framework_notify_fans(struct framework_data *data,
+				  const struct framework_snapshot *prev,
+				  const struct framework_snapshot *cur)
+{
+	if (prev->status < 0 || cur->status < 0)
+		return;
+
+	for (size_t i = 0; i < EC_FAN_SPEED_ENTRIES; i++) {
+		if (!(data->fan_mask & BIT(i)))
+			continue;
+
+		if ((prev->fans[i] == EC_FAN_SPEED_STALLED) !=
+		    (cur->fans[i] == EC_FAN_SPEED_STALLED))
+			hwmon_notify_event(data->hwmon_dev, hwmon_fan,
+					   hwmon_fan_alarm, i);
+
+		if ((prev->fans[i] == EC_FAN_SPEED_NOT_PRESENT) !=
+		    (cur->fans[i] == EC_FAN_SPEED_NOT_PRESENT))
+			hwmon_notify_event(data->hwmon_dev, hwmon_fan,
+					   hwmon_fan_fault, i);
+	}
+}
+
+static void framework_poll(struct framework_data *data)
+{
+	struct framework_snapshot prev, cur;
+
+	mutex_lock(&data->poll_mutex);
+	framework_read_snapshot(data, &prev);
+	framework_update_snapshot(data, "poll");
+	framework_read_snapshot(data, &cur);
+
+	framework_notify_fans(data, &prev, &cur);
+	framework_notify_battery(data, &prev, &cur);
+	framework_ring_push(data, &cur);
+	framework_poll_adapt(data, &prev, &cur);
+	framework_fan_history(data, &cur);
+	framework_power_history(data, &cur);
+	framework_curve_eval(data, &cur);
+
+	if (data->privacy.input &&
+	    time_after(jiffies, READ_ONCE(data->privacy.checked) +
+				msecs_to_jiffies(FW_PRIVACY_RECHECK_INTERVAL)))
+		framework_privacy_refresh(data, "poll");
+	mutex_unlock(&data->poll_mutex);
+
+	framework_poll_kick(data, framework_poll_delay(data));
+}
+
+static void framework_poll_work(struct work_struct *work)
+{
+	framework_poll(container_of(to_delayed_work(work), struct framework_data,
+				    poll_work));
+}
+
+static void framework_poll_work_timely(struct work_struct *work)
+{
+	framework_poll(container_of(to_delayed_work(work), struct framework_data,
+				    poll_work_timely));
+}
+
+// --- telemetry ---
+#define FW_TELEMETRY_VERSION 2
+
+// Everything the driver knows, as one key=value pair per line. Keys are
+// only added in later versions, never changed or removed; values that
+// aren't available are left out.
+static ssize_t telemetry_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct framework_data *data = dev_get_drvdata(dev);
+	struct ec_response_privacy_switches_check privacy;
+	struct framework_snapshot snap;
+	int len = 0;
+	bool valid;
+	long value;
+	u32 rpm;
+	int ret;
+
+	framework_poll_touch(data);
+	framework_read_snapshot(data, &snap);
+
+	len += sysfs_emit_at(buf, len, "version=%d\n", FW_TELEMETRY_VERSION);
+	len += sysfs_emit_at(buf, len, "timestamp_ns=%llu\n", snap.timestamp);
+
+	if (data->hwmon_dev && snap.status == 0) {
+		for (size_t i = 0; i < EC_FAN_SPEED_ENTRIES; i++) {
+			u16 speed = snap.fans[i];
+
+			if (!(data->fan_mask & BIT(i)))
+				continue;
+
+			len += sysfs_emit_at(buf, len, "fan%zu_input=%u\n", i + 1,
+					     speed == EC_FAN_SPEED_NOT_PRESENT ||
+					     speed == EC_FAN_SPEED_STALLED ? 0 : speed);
+			len += sysfs_emit_at(buf, len, "fan%zu_fault=%u\n", i + 1,
+					     speed == EC_FAN_SPEED_NOT_PRESENT);
+			len += sysfs_emit_at(buf, len, "fan%zu_alarm=%u\n", i + 1,
+					     speed == EC_FAN_SPEED_STALLED);
+		}
+
+		for (size_t i = 0; i < EC_TEMP_SENSOR_ENTRIES; i++) {
+			u8 temp = snap.temps[i];
+
+			if (!(data->temp_mask & BIT(i)) ||
+			    temp >= EC_TEMP_SENSOR_NOT_CALIBRATED)
+				continue;
+
+			len += sysfs_emit_at(buf, len, "temp%zu_input=%ld\n", i + 1,
+					     kelvin_to_millicelsius(temp + EC_TEMP_SENSOR_OFFSET));
+		}
+	}
+
+	if (data->has_battery && snap.battery_status == 0 &&
+	    (snap.battery.flag & EC_BATT_FLAG_BATT_PRESENT)) {
+		len += sysfs_emit_at(buf, len, "battery_voltage_mv=%u\n",
+				     snap.battery.volt);
+		len += sysfs_emit_at(buf, len, "battery_rate_ma=%u\n",
+				     snap.battery.rate);
+		len += sysfs_emit_at(buf, len, "battery_capacity_mah=%u\n",
+				     snap.battery.cap);
+		len += sysfs_emit_at(buf, len, "battery_flags=0x%02x\n",
+				     snap.battery.flag);
+	}
+
+	if (fw_system_power(&snap, &value) == 0)
+		len += sysfs_emit_at(buf, len, "system_power_uw=%ld\n", value);
+	if (fw_charger_current(&snap, &value) == 0)
+		len += sysfs_emit_at(buf, len, "charger_current_ma=%ld\n", value);
+
+	// The rest is what the driver last sent to or heard from the EC, so a
+	// read never costs a host command
+	for (size_t i = 0; i < EC_FAN_SPEED_ENTRIES; i++) {
+		struct framework_fan *fan = &data->fans[i];
+		bool target;
+
+		if (!(data->fan_mask & BIT(i)))
+			continue;
+
+		spin_lock(&fan->lock);
+		target = fan->mode == FW_FAN_MODE_RPM;
+		rpm = fan->rpm;
+		spin_unlock(&fan->lock);
+
+		if (target)
+			len += sysfs_emit_at(buf, len, "fan%zu_target=%u\n",
+					     i + 1, rpm);
+	}
+
+	ret = READ_ONCE(data->charge_limit_seen);
+	if (ret >= 0)
+		len += sysfs_emit_at(buf, len, "charge_control_end_threshold=%d\n",
+				     ret);
+
+	mutex_lock(&data->privacy.lock);
+	valid = data->privacy.valid;
+	privacy = data->privacy.state;
+	mutex_unlock(&data->privacy.lock);
+	if (valid) {
+		len += sysfs_emit_at(buf, len, "privacy_microphone=%s\n",
+				     privacy.microphone ? "unmuted" : "muted");
+		len += sysfs_emit_at(buf, len, "privacy_camera=%s\n",
+				     privacy.camera ? "unmuted" : "muted");
+	}
+
+	return len;
+}
+
+// --- hwmon ---
+static umode_t fw_hwmon_is_visible(const void *drvdata,
+				   enum hwmon_sensor_types type, u32 attr,
+				   int channel)
+{
+	const struct framework_data *data = drvdata;
+
+	switch (type) {
+	case hwmon_chip:
+		if (attr == hwmon_chip_update_interval)
+			return 0644;
+		break;
+	case hwmon_in:
+		if (data->has_battery &&
+		    (attr == hwmon_in_input || attr == hwmon_in_label))
+			return 0444;
+		break;
+	case hwmon_curr:
+		if (attr != hwmon_curr_input && attr != hwmon_curr_label)
+			break;
+		if (channel == 0 ? data->has_battery :
+				   fw_ec_has(data, FW_CAP_POWER_INFO, 0))
+			return 0444;
+		break;
+	case hwmon_power:
+		if (channel == 0) {
+			if (data->has_battery &&
+			    (attr == hwmon_power_input || attr == hwmon_power_label))
+				return 0444;
+			break;
+		}
+		if (!data->has_battery && !fw_ec_has(data, FW_CAP_POWER_INFO, 0))
+			break;
+		switch (attr) {
+		case hwmon_power_input:
+		case hwmon_power_average:
+		case hwmon_power_label:
+			return 0444;
+		case hwmon_power_average_interval:
+			return 0644;
+		}
+		break;
+	case hwmon_temp:
+		if (!(data->temp_mask & BIT(channel)))
+			return 0;
+		switch (attr) {
+		case hwmon_temp_input:
+			return 0444;
+		case hwmon_temp_label:
+			return data->temp_labels[channel] ? 0444 : 0;
+		}
+		break;
+	case hwmon_fan:
+		if (!(data->fan_mask & BIT(channel)))
+			return 0;
+		switch (attr) {
+		case hwmon_fan_input:
+		case hwmon_fan_fault:
+		case hwmon_fan_alarm:
+			return 0444;
+		case hwmon_fan_target:
+			// A target set through the driver can always be read
+			// back, but the EC can only report its own for fan 0
+			if (fw_fan_cmd_version(data, FW_CAP_FAN_TARGET_SET) >= 0)
+				return 0644;
+			if (channel == 0 && fw_ec_has(data, FW_CAP_FAN_TARGET_GET, 0))
+				return 0444;
+			return 0;
+		}
+		break;
+	case hwmon_pwm:
+		if (!(data->fan_mask & BIT(channel)))
+			return 0;
+		switch (attr) {
+		case hwmon_pwm_input:
+			return fw_fan_cmd_version(data, FW_CAP_FAN_DUTY) >= 0 ? 0644 : 0;
+		case hwmon_pwm_enable:
+			return fw_fan_cmd_version(data, FW_CAP_AUTO_FAN) >= 0 ? 0644 : 0;
+		}
+		break;
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+static int fw_temp_read(struct framework_data *data, u32 attr, int channel,
+			long *val)
+{
+	u8 temp;
+
+	if (attr != hwmon_temp_input)
+		return -EOPNOTSUPP;
+
+	if (ec_get_temp(data, channel, &temp) < 0)
+		return -EIO;
+
+	// Not present, error, not powered or not calibrated
+	if (temp >= EC_TEMP_SENSOR_NOT_CALIBRATED)
+		return -ENODATA;
+
+	*val = kelvin_to_millicelsius(temp + EC_TEMP_SENSOR_OFFSET);
+	return 0;
+}
+
+// Battery voltage in mV, current in mA (negative while discharging) and
+// power in uW
+static int fw_battery_read(struct framework_data *data,
+			   enum hwmon_sensor_types type, u32 attr, long *val)
+{
+	struct framework_memmap_battery battery;
+	long current_ma;
+	ssize_t ret;
+
+	ret = ec_get_battery(data, &battery);
+	if (ret < 0)
+		return ret;
+
+	current_ma = battery.rate;
+	if (battery.flag & EC_BATT_FLAG_DISCHARGING)
+		current_ma = -current_ma;
+
+	switch (type) {
+	case hwmon_in:
+		if (attr != hwmon_in_input)
+			break;
+		*val = battery.volt;
+		return 0;
+	case hwmon_curr:
+		if (attr != hwmon_curr_input)
+			break;
+		*val = current_ma;
+		return 0;
+	case hwmon_power:
+		if (attr != hwmon_power_input)
+			break;
+		*val = (long)battery.volt * battery.rate;
+		return 0;
+	default:
+		break;
+	}
+
+	return -EOPNOTSUPP;
+}
+
+// System power in uW and its average, and the charger current in mA
+static int fw_power_read(struct framework_data *data,
+			 enum hwmon_sensor_types type, u32 attr, long *val)
+{
+	struct framework_snapshot snap;
+	bool valid;
+
+	if (type == hwmon_power && attr == hwmon_power_average) {
+		spin_lock(&data->power_lock);
+		valid = data->power_has_average;
+		*val = data->power_average;
+		spin_unlock(&data->power_lock);
+		return valid ? 0 : -ENODATA;
+	}
+
+	if (type == hwmon_power && attr == hwmon_power_average_interval) {
+		*val = READ_ONCE(data->power_average_interval);
+		return 0;
+	}
+
+	framework_read_snapshot(data, &snap);
+
+	if (type == hwmon_power && attr == hwmon_power_input)
+		return fw_system_power(&snap, val);
+	if (type == hwmon_curr && attr == hwmon_curr_input)
+		return fw_charger_current(&snap, val);
+
+	return -EOPNOTSUPP;
+}
+
+static int fw_fan_read(struct framework_data *data, u32 attr, int channel,
+		       long *val)
+{
+	struct framework_fan *fan = &data->fans[channel];
+	enum framework_fan_mode mode;
+	u16 speed;
+	u32 rpm;
+
+	if (attr == hwmon_fan_target) {
+		spin_lock(&fan->lock);
+		mode = fan->mode;
+		rpm = fan->rpm;
+		spin_unlock(&fan->lock);
+
+		// Otherwise the EC picks the target, and can only report it
+		// for fan 0
+		if (mode != FW_FAN_MODE_RPM) {
+			if (channel != 0)
+				return -ENODATA;
+			if (ec_get_target_rpm(data, channel, &rpm,
+					      fw_origin_fan_target[channel]) < 0)
+				return -EIO;
+		}
+
+		*val = rpm;
+		return 0;
+	}
+
+	if (ec_get_fan_speed(data, channel, &speed) < 0)
+		return -EIO;
+
+	switch (attr) {
+	case hwmon_fan_input:
+		if (speed == EC_FAN_SPEED_NOT_PRESENT ||
+		    speed == EC_FAN_SPEED_STALLED)
+			*val = 0;
+		else
+			*val = speed;
+		return 0;
+	case hwmon_fan_fault:
+		*val = speed == EC_FAN_SPEED_NOT_PRESENT;
+		return 0;
+	case hwmon_fan_alarm:
+		*val = speed == EC_FAN_SPEED_STALLED;
+		return 0;
+	}
+
+	return -EOPNOTSUPP;
+}
+
+// Both come from what was last requested, since the EC can't report them
+static int fw_pwm_read(struct framework_data *data, u32 attr, int channel,
+		       long *val)
+{
+	struct framework_fan *fan = &data->fans[channel];
+	bool curve = READ_ONCE(data->curves[channel].enabled);
+	enum framework_fan_mode mode;
+	bool has_duty;
+	u32 duty;
+
+	spin_lock(&fan->lock);
+	mode = fan->mode;
+	duty = fan->duty;
+	has_duty = fan->has_duty;
+	spin_unlock(&fan->lock);
+
+	switch (attr) {
+	case hwmon_pwm_input:
+		if (!has_duty)
+			return -ENODATA;
+
+		*val = duty;
+		return 0;
+	case hwmon_pwm_enable:
+		// 1 is manual, 2 is EC automatic control, 3 is the curve
+		if (curve)
+			*val = 3;
+		else
+			*val = mode == FW_FAN_MODE_AUTO ? 2 : 1;
+		return 0;
+	}
+
+	return -EOPNOTSUPP;
+}
+
+static int fw_hwmon_read(struct device *dev, enum hwmon_sensor_types type,
+			 u32 attr, int channel, long *val)
+{
+	struct framework_data *data = dev_get_drvdata(dev);
+
+	if (type != hwmon_chip)
+		framework_poll_touch(data);
+
+	switch (type) {
+	case hwmon_chip:
+		if (attr == hwmon_chip_update_interval) {
+			*val = READ_ONCE(data->poll_interval);
+			return 0;
+		}
+		break;
+	case hwmon_curr:
+	case hwmon_power:
+		if (channel == 1)
+			return fw_power_read(data, type, attr, val);
+		fallthrough;
+	case hwmon_in:
+		return fw_battery_read(data, type, attr, val);
+	case hwmon_temp:
+		return fw_temp_read(data, attr, channel, val);
+	case hwmon_fan:
+		return fw_fan_read(data, attr, channel, val);
+	case hwmon_pwm:
+		return fw_pwm_read(data, attr, channel, val);
+	default:
+		break;
+	}
+
+	return -EOPNOTSUPP;
+}
+
+static int fw_hwmon_read_string(struct device *dev,
+				enum hwmon_sensor_types type, u32 attr,
+				int channel, const char **str)
+{
+	struct framework_data *data = dev_get_drvdata(dev);
+
+	switch (type) {
+	case hwmon_in:
+		*str = "Battery voltage";
+		return 0;
+	case hwmon_curr:
+		*str = channel ? "Charger current" : "Battery current";
+		return 0;
+	case hwmon_power:
+		*str = channel ? "System power" : "Battery power";
+		return 0;
+	case hwmon_temp:
+		if (attr != hwmon_temp_label)
+			break;
+		*str = data->temp_labels[channel];
+		return 0;
+	default:
+		break;
+	}
+
+	return -EOPNOTSUPP;
+}
+
+// 1 is manual, 2 is EC automatic control and 3 is the fan curve
+static int fw_pwm_enable_write(struct framework_data *data, int channel,
+			       long val)
+{
+	struct framework_fan *fan = &data->fans[channel];
+	enum framework_fan_mode mode;
+	bool has_duty;
+	u32 value;
+
+	switch (val) {
+	case 1:
+		// Stay at (or go back to) the last duty or target speed
+		spin_lock(&fan->lock);
+		mode = fan->mode;
+		has_duty = fan->has_duty;
+		value = mode == FW_FAN_MODE_RPM ? fan->rpm : fan->duty;
+		spin_unlock(&fan->lock);
+
+		if (mode == FW_FAN_MODE_AUTO) {
+			if (!has_duty)
+				return -EINVAL;
+			mode = FW_FAN_MODE_DUTY;
+		}
+
+		framework_curve_select(data, channel, false, mode, value,
+				       fw_origin_pwm_enable[channel]);
+		return 0;
+	case 2:
+		framework_curve_select(data, channel, false, FW_FAN_MODE_AUTO, 0,
+				       fw_origin_pwm_enable[channel]);
+		return 0;
+	case 3:
+		if (fw_fan_cmd_version(data, FW_CAP_FAN_DUTY) < 0)
+			return -EOPNOTSUPP;
+
+		framework_curve_select(data, channel, true, FW_FAN_MODE_AUTO, 0,
+				       fw_origin_pwm_enable[channel]);
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+static int fw_hwmon_write(struct device *dev, enum hwmon_sensor_types type,
+			  u32 attr, int channel, long val)
+{
+	struct framework_data *data = dev_get_drvdata(dev);
+
+	switch (type) {
+	case hwmon_chip:
+		if (attr != hwmon_chip_update_interval)
+			break;
+
+		val = clamp_val(val, FW_POLL_INTERVAL_MIN, FW_POLL_INTERVAL_MAX);
+		WRITE_ONCE(data->poll_interval, val);
+		WRITE_ONCE(data->poll_effective, val);
+		// Apply the new interval now rather than after the old one
+		framework_poll_kick(data, framework_poll_delay(data));
+		return 0;
+	case hwmon_power:
+		if (attr != hwmon_power_average_interval)
+			break;
+
+		val = clamp_val(val, 1, FW_AVERAGE_INTERVAL_MAX);
+		WRITE_ONCE(data->power_average_interval, val);
+		return 0;
+	case hwmon_fan:
+		if (attr != hwmon_fan_target)
+			break;
+		if (val < 0 || val > U32_MAX)
+			return -EINVAL;
 
-	struct cros_ec_device *ec = dev_get_drvdata(ec_device);
+		framework_curve_select(data, channel, false, FW_FAN_MODE_RPM, val,
+				       fw_origin_fan_target[channel]);
+		return 0;
+	case hwmon_pwm:
+		switch (attr) {
+		case hwmon_pwm_input:
+			if (val < 0 || val > 100)
+				return -EINVAL;
+
+			framework_curve_select(data, channel, false, FW_FAN_MODE_DUTY,
+					       val, fw_origin_pwm[channel]);
+			return 0;
+		case hwmon_pwm_enable:
+			return fw_pwm_enable_write(data, channel, val);
+		}
+		break;
+	default:
+		break;
+	}
 
-	struct ec_params_auto_fan_ctrl_v1 params = {
-		.fan_idx = idx,
-	};
+	return -EOPNOTSUPP;
+}
 
-	ret = cros_ec_cmd(ec, 1, EC_CMD_THERMAL_AUTO_FAN_CTRL, &params,
-			  sizeof(params), NULL, 0);
-	if (ret < 0)
-		return -EIO;
+static const struct hwmon_ops fw_hwmon_ops = {
+	.is_visible = fw_hwmon_is_visible,
+	.read = fw_hwmon_read,
+	.read_string = fw_hwmon_read_string,
+	.write = fw_hwmon_write,
+};
 
-	return 0;
-}
+// clang-format off
+static const struct hwmon_channel_info *fw_hwmon_info[] = {
+	HWMON_CHANNEL_INFO(chip, HWMON_C_UPDATE_INTERVAL),
+	HWMON_CHANNEL_INFO(in, HWMON_I_INPUT | HWMON_I_LABEL),
+	HWMON_CHANNEL_INFO(curr,
+			   HWMON_C_INPUT | HWMON_C_LABEL,
+			   HWMON_C_INPUT | HWMON_C_LABEL),
+	HWMON_CHANNEL_INFO(power,
+			   HWMON_P_INPUT | HWMON_P_LABEL,
+			   HWMON_P_INPUT | HWMON_P_AVERAGE |
+			   HWMON_P_AVERAGE_INTERVAL | HWMON_P_LABEL),
+	HWMON_CHANNEL_INFO(temp,
+			   HWMON_T_INPUT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_LABEL),
+	HWMON_CHANNEL_INFO(fan,
+			   HWMON_F_INPUT | HWMON_F_TARGET | HWMON_F_FAULT | HWMON_F_ALARM,
+			   HWMON_F_INPUT | HWMON_F_TARGET | HWMON_F_FAULT | HWMON_F_ALARM,
+			   HWMON_F_INPUT | HWMON_F_TARGET | HWMON_F_FAULT | HWMON_F_ALARM,
+			   HWMON_F_INPUT | HWMON_F_TARGET | HWMON_F_FAULT | HWMON_F_ALARM),
+	HWMON_CHANNEL_INFO(pwm,
+			   HWMON_PWM_INPUT | HWMON_PWM_ENABLE,
+			   HWMON_PWM_INPUT | HWMON_PWM_ENABLE,
+			   HWMON_PWM_INPUT | HWMON_PWM_ENABLE,
+			   HWMON_PWM_INPUT | HWMON_PWM_ENABLE),
+	NULL,
+};
+// clang-format on
 
-static ssize_t fw_pwm_enable_store(struct device *dev,
-				   struct device_attribute *attr,
-				   const char *buf, size_t count)
-{
-	struct sensor_device_attribute *sen_attr = to_sensor_dev_attr(attr);
+static const struct hwmon_chip_info fw_hwmon_chip_info = {
+	.ops = &fw_hwmon_ops,
+	.info = fw_hwmon_info,
+};
 
-	// The EC doesn't take any arguments for this command,
-	// so we don't need to parse the buffer
-	// u32 val;
+// pwmN_min, pwmN_max, pwmN_status and the fan history have no hwmon core
+// equivalent. pwmN_status is the result of the last control write sent to
+// the EC.
+static SENSOR_DEVICE_ATTR_RO(pwm1_min, fw_pwm_min, 0);
+static SENSOR_DEVICE_ATTR_RO(pwm1_max, fw_pwm_max, 0);
+static SENSOR_DEVICE_ATTR_RO(pwm1_status, fw_pwm_status, 0);
+static SENSOR_DEVICE_ATTR_RO(fan1_input_lowest, fw_fan_lowest, 0);
+static SENSOR_DEVICE_ATTR_RO(fan1_input_highest, fw_fan_highest, 0);
+static SENSOR_DEVICE_ATTR_RO(fan1_average, fw_fan_average, 0);
+static SENSOR_DEVICE_ATTR_RW(fan1_average_interval, fw_fan_average_interval, 0);
+static SENSOR_DEVICE_ATTR_WO(fan1_reset_history, fw_fan_reset_history, 0);
+static SENSOR_DEVICE_ATTR_RO(pwm2_min, fw_pwm_min, 1);
+static SENSOR_DEVICE_ATTR_RO(pwm2_max, fw_pwm_max, 1);
+static SENSOR_DEVICE_ATTR_RO(pwm2_status, fw_pwm_status, 1);
+static SENSOR_DEVICE_ATTR_RO(fan2_input_lowest, fw_fan_lowest, 1);
+static SENSOR_DEVICE_ATTR_RO(fan2_input_highest, fw_fan_highest, 1);
+static SENSOR_DEVICE_ATTR_RO(fan2_average, fw_fan_average, 1);
+static SENSOR_DEVICE_ATTR_RW(fan2_average_interval, fw_fan_average_interval, 1);
+static SENSOR_DEVICE_ATTR_WO(fan2_reset_history, fw_fan_reset_history, 1);
+static SENSOR_DEVICE_ATTR_RO(pwm3_min, fw_pwm_min, 2);
+static SENSOR_DEVICE_ATTR_RO(pwm3_max, fw_pwm_max, 2);
+static SENSOR_DEVICE_ATTR_RO(pwm3_status, fw_pwm_status, 2);
+static SENSOR_DEVICE_ATTR_RO(fan3_input_lowest, fw_fan_lowest, 2);
+static SENSOR_DEVICE_ATTR_RO(fan3_input_highest, fw_fan_highest, 2);
+static SENSOR_DEVICE_ATTR_RO(fan3_average, fw_fan_average, 2);
+static SENSOR_DEVICE_ATTR_RW(fan3_average_interval, fw_fan_average_interval, 2);
+static SENSOR_DEVICE_ATTR_WO(fan3_reset_history, fw_fan_reset_history, 2);
+static SENSOR_DEVICE_ATTR_RO(pwm4_min, fw_pwm_min, 3);
+static SENSOR_DEVICE_ATTR_RO(pwm4_max, fw_pwm_max, 3);
+static SENSOR_DEVICE_ATTR_RO(pwm4_status, fw_pwm_status, 3);
+static SENSOR_DEVICE_ATTR_RO(fan4_input_lowest, fw_fan_lowest, 3);
+static SENSOR_DEVICE_ATTR_RO(fan4_input_highest, fw_fan_highest, 3);
+static SENSOR_DEVICE_ATTR_RO(fan4_average, fw_fan_average, 3);
+static SENSOR_DEVICE_ATTR_RW(fan4_average_interval, fw_fan_average_interval, 3);
+static SENSOR_DEVICE_ATTR_WO(fan4_reset_history, fw_fan_reset_history, 3);
+
+static struct attribute *fw_hwmon_attrs[] = {
+	&sensor_dev_attr_pwm1_min.dev_attr.attr,
+	&sensor_dev_attr_pwm1_max.dev_attr.attr,
+	&sensor_dev_attr_pwm1_status.dev_attr.attr,
+	&sensor_dev_attr_fan1_input_lowest.dev_attr.attr,
+	&sensor_dev_attr_fan1_input_highest.dev_attr.attr,
+	&sensor_dev_attr_fan1_average.dev_attr.attr,
+	&sensor_dev_attr_fan1_average_interval.dev_attr.attr,
+	&sensor_dev_attr_fan1_reset_history.dev_attr.attr,
+	&sensor_dev_attr_pwm2_min.dev_attr.attr,
+	&sensor_dev_attr_pwm2_max.dev_attr.attr,
+	&sensor_dev_attr_pwm2_status.dev_attr.attr,
+	&sensor_dev_attr_fan2_input_lowest.dev_attr.attr,
+	&sensor_dev_attr_fan2_input_highest.dev_attr.attr,
+	&sensor_dev_attr_fan2_average.dev_attr.attr,
+	&sensor_dev_attr_fan2_average_interval.dev_attr.attr,
+	&sensor_dev_attr_fan2_reset_history.dev_attr.attr,
+	&sensor_dev_attr_pwm3_min.dev_attr.attr,
+	&sensor_dev_attr_pwm3_max.dev_attr.attr,
+	&sensor_dev_attr_pwm3_status.dev_attr.attr,
+	&sensor_dev_attr_fan3_input_lowest.dev_attr.attr,
+	&sensor_dev_attr_fan3_input_highest.dev_attr.attr,
+	&sensor_dev_attr_fan3_average.dev_attr.attr,
+	&sensor_dev_attr_fan3_average_interval.dev_attr.attr,
+	&sensor_dev_attr_fan3_reset_history.dev_attr.attr,
+	&sensor_dev_attr_pwm4_min.dev_attr.attr,
+	&sensor_dev_attr_pwm4_max.dev_attr.attr,
+	&sensor_dev_attr_pwm4_status.dev_attr.attr,
+	&sensor_dev_attr_fan4_input_lowest.dev_attr.attr,
+	&sensor_dev_attr_fan4_input_highest.dev_attr.attr,
+	&sensor_dev_attr_fan4_average.dev_attr.attr,
+	&sensor_dev_attr_fan4_average_interval.dev_attr.attr,
+	&sensor_dev_attr_fan4_reset_history.dev_attr.attr,
+	NULL,
+};
 
-	// int err;
-	// err = kstrtou32(buf, 10, &val);
-	// if (err < 0)
-	// 	return err;
+static umode_t fw_hwmon_attr_is_visible(struct kobject *kobj,
+					struct attribute *attr, int n)
+{
+	struct framework_data *data = dev_get_drvdata(kobj_to_dev(kobj));
+	struct device_attribute *dev_attr =
+		container_of(attr, struct device_attribute, attr);
 
-	if (ec_set_auto_fan_ctrl(sen_attr->index) < 0) {
-		return -EIO;
-	}
+	if (!(data->fan_mask & BIT(to_sensor_dev_attr(dev_attr)->index)))
+		return 0;
 
-	return count;
+	return attr->mode;
 }
 
-// --- pwmN ---
-static ssize_t ec_set_fan_duty(u8 idx, u32 *val)
+static const struct attribute_group fw_hwmon_group = {
+	.attrs = fw_hwmon_attrs,
+	.is_visible = fw_hwmon_attr_is_visible,
+};
+
+// fan_duty_all sets every fan at once: one token per fan, in order, each
+// being a duty in percent, "rpm:N", "auto", or "-" to leave the fan alone.
+// The whole vector is checked before anything is sent.
+static int fw_duty_all_parse(const struct framework_data *data,
+			     const char *tok, struct framework_fan_request *req,
+			     bool *set)
 {
+	enum framework_ec_cap cap;
 	int ret;
-	if (!ec_device)
-		return -ENODEV;
-
-	struct cros_ec_device *ec = dev_get_drvdata(ec_device);
 
-	struct ec_params_pwm_set_fan_duty_v1 params = {
-		.percent = *val,
-		.fan_idx = idx,
-	};
+	*set = true;
+	req->origin = "fan_duty_all";
+	if (!strcmp(tok, "-")) {
+		*set = false;
+		return 0;
+	} else if (!strcmp(tok, "auto")) {
+		req->mode = FW_FAN_MODE_AUTO;
+		req->value = 0;
+		cap = FW_CAP_AUTO_FAN;
+	} else if (str_has_prefix(tok, "rpm:")) {
+		req->mode = FW_FAN_MODE_RPM;
+		ret = kstrtou32(tok + strlen("rpm:"), 10, &req->value);
+		if (ret)
+			return ret;
+		cap = FW_CAP_FAN_TARGET_SET;
+	} else {
+		req->mode = FW_FAN_MODE_DUTY;
+		ret = kstrtou32(tok, 10, &req->value);
+		if (ret)
+			return ret;
+		if (req->value > 100)
+			return -EINVAL;
+		cap = FW_CAP_FAN_DUTY;
+	}
 
-	ret = cros_ec_cmd(ec, 1, EC_CMD_PWM_SET_FAN_DUTY, &params,
-			  sizeof(params), NULL, 0);
-	if (ret < 0)
-		return -EIO;
+	if (fw_fan_cmd_version(data, cap) < 0)
+		return -EOPNOTSUPP;
 
 	return 0;
 }
 
-static ssize_t fw_pwm_store(struct device *dev, struct device_attribute *attr,
-			    const char *buf, size_t count)
+static ssize_t fan_duty_all_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
 {
-	struct sensor_device_attribute *sen_attr = to_sensor_dev_attr(attr);
-	u32 val;
-
-	int err;
-	err = kstrtou32(buf, 10, &val);
-	if (err < 0)
-		return err;
-
-	if (ec_set_fan_duty(sen_attr->index, &val) < 0) {
-		return -EIO;
+	struct framework_data *data = dev_get_drvdata(dev);
+	int len = 0;
+
+	mutex_lock(&data->curve_lock);
+	for (size_t i = 0; i < data->duty_all_count; i++) {
+		if (data->duty_all_sent[i])
+			len += sysfs_emit_at(buf, len, "%s%d", i ? " " : "",
+					     data->duty_all_results[i]);
+		else
+			len += sysfs_emit_at(buf, len, "%s-", i ? " " : "");
 	}
+	mutex_unlock(&data->curve_lock);
 
-	return count;
+	len += sysfs_emit_at(buf, len, "\n");
+	return len;
 }
 
-static ssize_t fw_pwm_min_show(struct device *dev,
-			       struct device_attribute *attr, char *buf)
+static ssize_t fan_duty_all_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
 {
-	return sysfs_emit(buf, "%i\n", 0);
-}
+	struct framework_data *data = dev_get_drvdata(dev);
+	struct framework_fan_request reqs[EC_FAN_SPEED_ENTRIES];
+	bool set[EC_FAN_SPEED_ENTRIES];
+	char *copy, *cur, *tok;
+	size_t n = 0;
+	int ret = 0;
 
-static ssize_t fw_pwm_max_show(struct device *dev,
-			       struct device_attribute *attr, char *buf)
-{
-	return sysfs_emit(buf, "%i\n", 100);
-}
+	copy = kstrdup(buf, GFP_KERNEL);
+	if (!copy)
+		return -ENOMEM;
 
-static ssize_t ec_count_fans(size_t *val)
-{
-	if (!ec_device)
-		return -ENODEV;
+	cur = strim(copy);
+	while ((tok = strsep(&cur, " \t")) != NULL) {
+		if (!*tok)
+			continue;
+		if (n >= EC_FAN_SPEED_ENTRIES) {
+			ret = -EINVAL;
+			break;
+		}
 
-	struct cros_ec_device *ec = dev_get_drvdata(ec_device);
+		ret = fw_duty_all_parse(data, tok, &reqs[n], &set[n]);
+		if (ret)
+			break;
+		// An absent fan can only be skipped
+		if (set[n] && !(data->fan_mask & BIT(n))) {
+			ret = -EINVAL;
+			break;
+		}
+		n++;
+	}
+	kfree(copy);
 
-	u16 fans[EC_FAN_SPEED_ENTRIES];
+	if (!ret && !n)
+		ret = -EINVAL;
+	if (ret)
+		return ret;
 
-	int ret = ec->cmd_readmem(ec, EC_MEMMAP_FAN, sizeof(fans), fans);
-	if (ret < 0)
-		return -EIO;
+	// Send them back to back. Holding the curve lock keeps the poller from
+	// changing any of the fans, and holding the EC gate keeps any other
+	// command from going out in between.
+	mutex_lock(&data->curve_lock);
+	for (size_t i = 0; i < n; i++) {
+		data->duty_all_sent[i] = set[i];
+		if (!set[i])
+			continue;
+
+		data->curves[i].enabled = false;
+		data->curves[i].duty = -1;
+		framework_fan_cancel(data, i);
+	}
 
-	for (size_t i = 0; i < EC_FAN_SPEED_ENTRIES; i++) {
-		if (fans[i] == EC_FAN_SPEED_NOT_PRESENT) {
-			*val = i;
-			return 0;
-		}
+	fw_ec_gate_enter(data, FW_EC_CONTROL);
+	for (size_t i = 0; i < n; i++) {
+		if (set[i])
+			data->duty_all_results[i] =
+				framework_fan_send_now(data, i, &reqs[i]);
 	}
+	fw_ec_gate_exit(data);
+	data->duty_all_count = n;
+	mutex_unlock(&data->curve_lock);
 
-	*val = EC_FAN_SPEED_ENTRIES;
-	return 0;
+	return count;
 }
 
-// --- framework_privacy ---
-static ssize_t framework_privacy_show(struct device *dev,
-				      struct device_attribute *attr, char *buf)
-{
-	int ret;
-	if (!ec_device)
-		return -ENODEV;
-
-	struct cros_ec_device *ec = dev_get_drvdata(ec_device);
+static DEVICE_ATTR_RW(fan_duty_all);
 
-	struct ec_response_privacy_switches_check resp;
+static struct attribute *fw_hwmon_ctrl_attrs[] = {
+	&dev_attr_fan_duty_all.attr,
+	NULL,
+};
 
-	ret = cros_ec_cmd(ec, 0, EC_CMD_PRIVACY_SWITCHES_CHECK_MODE, NULL, 0,
-			  &resp, sizeof(resp));
-	if (ret < 0)
-		return -EIO;
+static umode_t fw_hwmon_ctrl_is_visible(struct kobject *kobj,
+					struct attribute *attr, int n)
+{
+	struct framework_data *data = dev_get_drvdata(kobj_to_dev(kobj));
 
-	// Output following dell-privacy's format
-	return sysfs_emit(buf, "[Microphone] [%s]\n[Camera] [%s]\n",
-			  resp.microphone ? "unmuted" : "muted",
-			  resp.camera ? "unmuted" : "muted");
+	return data->fan_mask ? attr->mode : 0;
 }
 
-#define FW_ATTRS_PER_FAN 8
+static const struct attribute_group fw_hwmon_ctrl_group = {
+	.attrs = fw_hwmon_ctrl_attrs,
+	.is_visible = fw_hwmon_ctrl_is_visible,
+};
 
-// --- hwmon sysfs attributes ---
-// clang-format off
-static SENSOR_DEVICE_ATTR_RO(fan1_input, fw_fan_speed, 0); // Fan Reading
-static SENSOR_DEVICE_ATTR_RW(fan1_target, fw_fan_target, 0); // Target RPM (RW on fan 0 only)
-static SENSOR_DEVICE_ATTR_RO(fan1_fault, fw_fan_fault, 0); // Fan Not Present
-static SENSOR_DEVICE_ATTR_RO(fan1_alarm, fw_fan_alarm, 0); // Fan Stalled
-static SENSOR_DEVICE_ATTR_WO(pwm1_enable, fw_pwm_enable, 0); // Set Fan Control Mode
-static SENSOR_DEVICE_ATTR_WO(pwm1, fw_pwm, 0); // Set Fan Speed
-static SENSOR_DEVICE_ATTR_RO(pwm1_min, fw_pwm_min, 0); // Min Fan Speed
-static SENSOR_DEVICE_ATTR_RO(pwm1_max, fw_pwm_max, 0); // Max Fan Speed
-// clang-format on
+// Fan curve configuration: four temperature/duty points per fan, the
+// channels to follow, hysteresis in millidegrees and a ramp rate in percent
+// per second
+#define FW_CURVE_ATTRS(n, fan)								\
+	static SENSOR_DEVICE_ATTR_2_RW(pwm##n##_auto_point1_temp, fw_curve_point_temp, fan, 0); \
+	static SENSOR_DEVICE_ATTR_2_RW(pwm##n##_auto_point1_pwm, fw_curve_point_pwm, fan, 0);	\
+	static SENSOR_DEVICE_ATTR_2_RW(pwm##n##_auto_point2_temp, fw_curve_point_temp, fan, 1); \
+	static SENSOR_DEVICE_ATTR_2_RW(pwm##n##_auto_point2_pwm, fw_curve_point_pwm, fan, 1);	\
+	static SENSOR_DEVICE_ATTR_2_RW(pwm##n##_auto_point3_temp, fw_curve_point_temp, fan, 2); \
+	static SENSOR_DEVICE_ATTR_2_RW(pwm##n##_auto_point3_pwm, fw_curve_point_pwm, fan, 2);	\
+	static SENSOR_DEVICE_ATTR_2_RW(pwm##n##_auto_point4_temp, fw_curve_point_temp, fan, 3); \
+	static SENSOR_DEVICE_ATTR_2_RW(pwm##n##_auto_point4_pwm, fw_curve_point_pwm, fan, 3);	\
+	static SENSOR_DEVICE_ATTR_2_RW(pwm##n##_auto_channels_temp, fw_curve_channels, fan, 0); \
+	static SENSOR_DEVICE_ATTR_2_RW(pwm##n##_auto_point_temp_hyst, fw_curve_hyst, fan, 0);	\
+	static SENSOR_DEVICE_ATTR_2_RW(pwm##n##_auto_ramp_rate, fw_curve_ramp, fan, 0)
+
+#define FW_CURVE_ATTR_LIST(n)						\
+	&sensor_dev_attr_pwm##n##_auto_point1_temp.dev_attr.attr,	\
+	&sensor_dev_attr_pwm##n##_auto_point1_pwm.dev_attr.attr,	\
+	&sensor_dev_attr_pwm##n##_auto_point2_temp.dev_attr.attr,	\
+	&sensor_dev_attr_pwm##n##_auto_point2_pwm.dev_attr.attr,	\
+	&sensor_dev_attr_pwm##n##_auto_point3_temp.dev_attr.attr,	\
+	&sensor_dev_attr_pwm##n##_auto_point3_pwm.dev_attr.attr,	\
+	&sensor_dev_attr_pwm##n##_auto_point4_temp.dev_attr.attr,	\
+	&sensor_dev_attr_pwm##n##_auto_point4_pwm.dev_attr.attr,	\
+	&sensor_dev_attr_pwm##n##_auto_channels_temp.dev_attr.attr,	\
+	&sensor_dev_attr_pwm##n##_auto_point_temp_hyst.dev_attr.attr,	\
+	&sensor_dev_attr_pwm##n##_auto_ramp_rate.dev_attr.attr
+
+FW_CURVE_ATTRS(1, 0);
+FW_CURVE_ATTRS(2, 1);
+FW_CURVE_ATTRS(3, 2);
+FW_CURVE_ATTRS(4, 3);
+
+static struct attribute *fw_curve_attrs[] = {
+	FW_CURVE_ATTR_LIST(1),
+	FW_CURVE_ATTR_LIST(2),
+	FW_CURVE_ATTR_LIST(3),
+	FW_CURVE_ATTR_LIST(4),
+	NULL,
+};
 
-static SENSOR_DEVICE_ATTR_RO(fan2_input, fw_fan_speed, 1);
-static SENSOR_DEVICE_ATTR_WO(fan2_target, fw_fan_target, 1);
-static SENSOR_DEVICE_ATTR_RO(fan2_fault, fw_fan_fault, 1);
-static SENSOR_DEVICE_ATTR_RO(fan2_alarm, fw_fan_alarm, 1);
-static SENSOR_DEVICE_ATTR_WO(pwm2_enable, fw_pwm_enable, 1);
-static SENSOR_DEVICE_ATTR_WO(pwm2, fw_pwm, 1);
-static SENSOR_DEVICE_ATTR_RO(pwm2_min, fw_pwm_min, 1);
-static SENSOR_DEVICE_ATTR_RO(pwm2_max, fw_pwm_max, 1);
+static umode_t fw_curve_attr_is_visible(struct kobject *kobj,
+					struct attribute *attr, int n)
+{
+	struct framework_data *data = dev_get_drvdata(kobj_to_dev(kobj));
+	struct device_attribute *dev_attr =
+		container_of(attr, struct device_attribute, attr);
 
-static SENSOR_DEVICE_ATTR_RO(fan3_input, fw_fan_speed, 2);
-static SENSOR_DEVICE_ATTR_WO(fan3_target, fw_fan_target, 2);
-static SENSOR_DEVICE_ATTR_RO(fan3_fault, fw_fan_fault, 2);
-static SENSOR_DEVICE_ATTR_RO(fan3_alarm, fw_fan_alarm, 2);
-static SENSOR_DEVICE_ATTR_WO(pwm3_enable, fw_pwm_enable, 2);
-static SENSOR_DEVICE_ATTR_WO(pwm3, fw_pwm, 2);
-static SENSOR_DEVICE_ATTR_RO(pwm3_min, fw_pwm_min, 2);
-static SENSOR_DEVICE_ATTR_RO(pwm3_max, fw_pwm_max, 2);
+	if (!(data->fan_mask & BIT(to_sensor_dev_attr_2(dev_attr)->nr)))
+		return 0;
+	if (fw_fan_cmd_version(data, FW_CAP_FAN_DUTY) < 0)
+		return 0;
 
-static SENSOR_DEVICE_ATTR_RO(fan4_input, fw_fan_speed, 3);
-static SENSOR_DEVICE_ATTR_WO(fan4_target, fw_fan_target, 3);
-static SENSOR_DEVICE_ATTR_RO(fan4_fault, fw_fan_fault, 3);
-static SENSOR_DEVICE_ATTR_RO(fan4_alarm, fw_fan_alarm, 3);
-static SENSOR_DEVICE_ATTR_WO(pwm4_enable, fw_pwm_enable, 3);
-static SENSOR_DEVICE_ATTR_WO(pwm4, fw_pwm, 3);
-static SENSOR_DEVICE_ATTR_RO(pwm4_min, fw_pwm_min, 3);
-static SENSOR_DEVICE_ATTR_RO(pwm4_max, fw_pwm_max, 3);
+	return attr->mode;
+}
 
-static struct attribute
-	*fw_hwmon_attrs[(EC_FAN_SPEED_ENTRIES * FW_ATTRS_PER_FAN) + 1] = {
-		&sensor_dev_attr_fan1_input.dev_attr.attr,
-		&sensor_dev_attr_fan1_target.dev_attr.attr,
-		&sensor_dev_attr_fan1_fault.dev_attr.attr,
-		&sensor_dev_attr_fan1_alarm.dev_attr.attr,
-		&sensor_dev_attr_pwm1_enable.dev_attr.attr,
-		&sensor_dev_attr_pwm1.dev_attr.attr,
-		&sensor_dev_attr_pwm1_min.dev_attr.attr,
-		&sensor_dev_attr_pwm1_max.dev_attr.attr,
-
-		&sensor_dev_attr_fan2_input.dev_attr.attr,
-		&sensor_dev_attr_fan2_target.dev_attr.attr,
-		&sensor_dev_attr_fan2_fault.dev_attr.attr,
-		&sensor_dev_attr_fan2_alarm.dev_attr.attr,
-		&sensor_dev_attr_pwm2_enable.dev_attr.attr,
-		&sensor_dev_attr_pwm2.dev_attr.attr,
-		&sensor_dev_attr_pwm2_min.dev_attr.attr,
-		&sensor_dev_attr_pwm2_max.dev_attr.attr,
-
-		&sensor_dev_attr_fan3_input.dev_attr.attr,
-		&sensor_dev_attr_fan3_target.dev_attr.attr,
-		&sensor_dev_attr_fan3_fault.dev_attr.attr,
-		&sensor_dev_attr_fan3_alarm.dev_attr.attr,
-		&sensor_dev_attr_pwm3_enable.dev_attr.attr,
-		&sensor_dev_attr_pwm3.dev_attr.attr,
-		&sensor_dev_attr_pwm3_min.dev_attr.attr,
-		&sensor_dev_attr_pwm3_max.dev_attr.attr,
-
-		&sensor_dev_attr_fan4_input.dev_attr.attr,
-		&sensor_dev_attr_fan4_target.dev_attr.attr,
-		&sensor_dev_attr_fan4_fault.dev_attr.attr,
-		&sensor_dev_attr_fan4_alarm.dev_attr.attr,
-		&sensor_dev_attr_pwm4_enable.dev_attr.attr,
-		&sensor_dev_attr_pwm4.dev_attr.attr,
-		&sensor_dev_attr_pwm4_min.dev_attr.attr,
-		&sensor_dev_attr_pwm4_max.dev_attr.attr,
-
-		NULL,
-	};
+static const struct attribute_group fw_curve_group = {
+	.attrs = fw_curve_attrs,
+	.is_visible = fw_curve_attr_is_visible,
+};
 
-ATTRIBUTE_GROUPS(fw_hwmon);
+static const struct attribute_group *fw_hwmon_groups[] = {
+	&fw_hwmon_group,
+	&fw_curve_group,
+	&fw_hwmon_ctrl_group,
+	NULL,
+};
 
 // --- generic sysfs attributes ---
 static DEVICE_ATTR_RO(framework_privacy);
+static DEVICE_ATTR_RO(telemetry);
 
 static struct attribute *framework_laptop_attrs[] = {
-	&dev_attr_framework_privacy.attr,
+	&dev_attr_telemetry.attr,
+	&dev_attr_ec_events.attr,
 	NULL,
 };
 
-ATTRIBUTE_GROUPS(framework_laptop);
+static const struct attribute_group framework_laptop_group = {
+	.attrs = framework_laptop_attrs,
+};
+
+__ATTRIBUTE_GROUPS(framework_laptop);
+
+static void framework_privacy_remove_file(void *_data)
+{
+	struct framework_data *data = _data;
+
+	device_remove_file(&data->pdev->dev, &dev_attr_framework_privacy);
+}
+
+// framework_privacy is only created once the EC has said it has the
+// switches, which is after the platform device's attribute groups are
+static int framework_privacy_register(struct framework_data *data)
+{
+	struct device *dev = &data->pdev->dev;
+	int ret;
+
+	if (!fw_ec_has(data, FW_CAP_PRIVACY, 0))
+		return 0;
+
+	ret = device_create_file(dev, &dev_attr_framework_privacy);
+	if (ret)
+		return ret;
+
+	ret = devm_add_action_or_reset(dev, framework_privacy_remove_file, data);
+	if (ret)
+		return ret;
+
+	return framework_privacy_probe(data);
+}
 
 // --- platform driver ---
 static struct acpi_battery_hook framework_laptop_battery_hook = {
@@ -652,6 +4371,7 @@ static struct acpi_battery_hook framework_laptop_battery_hook = {
 	.name = "Framework Laptop Battery Extension",
 };
 
+#ifndef FRAMEWORK_LAPTOP_KUNIT
 static const struct acpi_device_id device_ids[] = {
 	{"FRMW0001", 0},
 	{"FRMW0004", 0},
@@ -670,7 +4390,239 @@ static const struct dmi_system_id framework_laptop_dmi_table[] __initconst = {
 	{ /* sentinel */ }
 };
 MODULE_DEVICE_TABLE(dmi, framework_laptop_dmi_table);
+#endif
+
+// Any EC event may mean a cached response is stale
+static int framework_ec_event(struct notifier_block *nb,
+			      unsigned long queued_during_suspend, void *_notify)
+{
+	struct framework_data *data =
+		container_of(nb, struct framework_data, ec_notifier);
+	struct cros_ec_device *ec = _notify;
+
+	fw_ec_cache_invalidate(data);
+	framework_events_host(data, cros_ec_get_host_event(ec));
+
+	// Recheck the privacy switches, but not from inside the notifier chain
+	if (data->privacy.input)
+		queue_work(fw_wq, &data->privacy.work);
+
+	return NOTIFY_OK;
+}
+
+static void framework_unregister_notifier(void *_data)
+{
+	struct framework_data *data = _data;
+	struct cros_ec_device *ec = dev_get_drvdata(ec_device);
+
+	blocking_notifier_chain_unregister(&ec->event_notifier,
+					   &data->ec_notifier);
+}
+
+// Register the keyboard backlight, if the EC can set it
+static int framework_kb_led_register(struct framework_data *data)
+{
+	struct device *dev = &data->pdev->dev;
+	int ret;
+
+	if (!fw_ec_has(data, FW_CAP_KB_LED_SET, 0))
+		return 0;
+
+	ret = ec_get_kb_led(data, "setup");
+	data->kb_sent = ret;
+	data->kb_brightness = max(ret, 0);
+	// Registered before the LED, so it runs after the LED is gone
+	ret = devm_add_action_or_reset(dev, kb_led_flush, data);
+	if (ret)
+		return ret;
+
+	data->kb_led.name = DRV_NAME "::kbd_backlight";
+	data->kb_led.brightness_get = kb_led_get;
+	data->kb_led.brightness_set = kb_led_set;
+	data->kb_led.blink_set = kb_led_blink_set;
+	data->kb_led.pattern_set = kb_led_pattern_set;
+	data->kb_led.pattern_clear = kb_led_pattern_clear;
+	data->kb_led.max_brightness = 100;
+	return devm_led_classdev_register(dev, &data->kb_led);
+}
+
+// Everything that has to ask the EC, so that probe doesn't wait for it: find
+// out what the EC supports, register the LEDs, privacy switches and battery
+// extension, then take the first snapshot, find the fans and sensors, and
+// register hwmon
+static void framework_setup_work(struct work_struct *work)
+{
+	struct framework_data *data =
+		container_of(work, struct framework_data, setup_work);
+	struct device *dev = &data->pdev->dev;
+	struct cros_ec_device *ec = dev_get_drvdata(ec_device);
+	struct framework_memmap_battery battery;
+	struct device *hwmon_dev;
+	size_t fan_count;
+
+	fw_ec_probe_caps(data);
+
+	if (framework_kb_led_register(data))
+		dev_err(dev, DRV_NAME ": failed to register keyboard backlight.\n");
+	if (framework_ec_leds_register(dev, data))
+		dev_err(dev, DRV_NAME ": failed to register EC LEDs.\n");
+	if (framework_privacy_register(data))
+		dev_err(dev, DRV_NAME ": failed to register privacy switches.\n");
+
+	// The battery attributes depend on what the EC supports
+	battery_hook_register(&framework_laptop_battery_hook);
+	data->battery_hooked = true;
+
+	if (!ec->cmd_readmem) {
+		dev_err(dev, DRV_NAME ": fan readings could not be enabled for this EC %s.\n",
+			FRAMEWORK_LAPTOP_EC_DEVICE_NAME);
+		return;
+	}
+
+	// Take the first snapshot before anything can read it
+	framework_update_snapshot(data, "setup");
+
+	// Count the number of fans; only present ones get attributes
+	if (ec_count_fans(data, &fan_count) < 0) {
+		dev_err(dev, DRV_NAME ": failed to count fans.\n");
+		return;
+	}
+
+	if (ec_probe_temps(data) < 0) {
+		dev_err(dev, DRV_NAME ": failed to find temperature sensors.\n");
+		return;
+	}
+
+	data->has_battery = ec_get_battery(data, &battery) == 0;
+	// So telemetry has a charge limit before anyone reads or sets it
+	if (fw_ec_has(data, FW_CAP_CHARGE_LIMIT, 0))
+		charge_limit_control(data, CHG_LIMIT_GET_LIMIT, 0, "setup");
+
+	hwmon_dev = hwmon_device_register_with_info(dev, DRV_NAME, data,
+						    &fw_hwmon_chip_info,
+						    fw_hwmon_groups);
+	if (IS_ERR(hwmon_dev)) {
+		dev_err(dev, DRV_NAME ": failed to register hwmon device.\n");
+		return;
+	}
+	data->hwmon_dev = hwmon_dev;
+
+	framework_cooling_register(data);
+	framework_ring_register(data);
+	framework_poll_kick(data, framework_poll_delay(data));
+}
+
+// Put back what was last requested through the driver, all in one go so
+// userspace doesn't have to. Fans go first since they matter most.
+static void framework_resume_work(struct work_struct *work)
+{
+	struct framework_data *data =
+		container_of(work, struct framework_data, resume_work);
+	enum led_brightness brightness;
+	unsigned long flags;
+	int limit;
 
+	for (size_t i = 0; i < EC_FAN_SPEED_ENTRIES; i++) {
+		if (!data->resume_fans_valid[i])
+			continue;
+
+		framework_fan_cancel(data, i);
+		framework_fan_send_now(data, i, &data->resume_fans[i]);
+	}
+
+	// The EC took the curve fans back while suspended. Forget what was
+	// sent so the first evaluation goes out even if the duty is the same.
+	mutex_lock(&data->curve_lock);
+	for (size_t i = 0; i < EC_FAN_SPEED_ENTRIES; i++) {
+		struct framework_fan *fan = &data->fans[i];
+
+		if (!data->curves[i].enabled)
+			continue;
+
+		data->curves[i].duty = -1;
+		spin_lock(&fan->lock);
+		fan->has_sent = false;
+		spin_unlock(&fan->lock);
+	}
+	mutex_unlock(&data->curve_lock);
+
+	limit = READ_ONCE(data->charge_limit);
+	if (limit >= 0)
+		charge_limit_control(data, CHG_LIMIT_SET_LIMIT, limit, "resume");
+
+	if (data->kb_led.brightness_set) {
+		brightness = READ_ONCE(data->kb_brightness);
+		spin_lock_irqsave(&data->kb_lock, flags);
+		data->kb_sent = brightness;
+		spin_unlock_irqrestore(&data->kb_lock, flags);
+
+		if (ec_set_kb_led(data, brightness, "resume") < 0) {
+			spin_lock_irqsave(&data->kb_lock, flags);
+			data->kb_sent = -1;
+			spin_unlock_irqrestore(&data->kb_lock, flags);
+		}
+
+		kb_pattern_start(data);
+	}
+
+	// The fan curves are re-evaluated on the first snapshot
+	if (data->hwmon_dev)
+		framework_poll_start(data);
+}
+
+// Set up the locks, works and defaults, without talking to the EC or
+// touching the platform device, so that framework_laptop_kunit.c can use it
+static void framework_data_init(struct framework_data *data)
+{
+	seqlock_init(&data->snapshot_lock);
+	// Nothing has been read until the setup work runs
+	data->snapshot.status = -ENODATA;
+	data->snapshot.battery_status = -ENODATA;
+	data->snapshot.power_status = -ENODATA;
+	INIT_WORK(&data->setup_work, framework_setup_work);
+	INIT_WORK(&data->resume_work, framework_resume_work);
+	data->charge_limit = -1;
+	data->charge_limit_seen = -1;
+	// Deferrable, so the poller never wakes an idle CPU by itself unless
+	// framework_poll_timely() says someone is waiting for it
+	INIT_DEFERRABLE_WORK(&data->poll_work, framework_poll_work);
+	INIT_DELAYED_WORK(&data->poll_work_timely, framework_poll_work_timely);
+	mutex_init(&data->poll_mutex);
+	spin_lock_init(&data->poll_lock);
+	data->poll_interval = clamp_val(poll_interval, FW_POLL_INTERVAL_MIN,
+					FW_POLL_INTERVAL_MAX);
+	data->poll_effective = data->poll_interval;
+	spin_lock_init(&data->cache_lock);
+	for (size_t i = 0; i < FW_INFLIGHT_ENTRIES; i++)
+		init_completion(&data->inflight[i].done);
+	spin_lock_init(&data->gate_lock);
+	init_waitqueue_head(&data->gate_wait);
+	spin_lock_init(&data->stats_lock);
+	framework_fan_init(data);
+	framework_curve_init(data);
+
+	spin_lock_init(&data->kb_lock);
+	INIT_WORK(&data->kb_work, kb_led_work);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+	hrtimer_setup(&data->kb_timer, kb_led_timer, CLOCK_MONOTONIC,
+		      HRTIMER_MODE_REL);
+#else
+	hrtimer_init(&data->kb_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	data->kb_timer.function = kb_led_timer;
+#endif
+	// Unknown until the setup work asks the EC
+	data->kb_sent = -1;
+
+	framework_privacy_init(data);
+
+	spin_lock_init(&data->events_lock);
+	INIT_WORK(&data->events_work, framework_events_work);
+	data->ec_notifier.notifier_call = framework_ec_event;
+}
+
+// framework_laptop_kunit.c includes this file to test it, and must not
+// register the driver or match the hardware
+#ifndef FRAMEWORK_LAPTOP_KUNIT
 static int device_match_cros_ec(struct device *dev, const void* foo) {
 	const char* name = dev_name(dev);
 	if (strncmp(name, "cros-ec-dev", 11))
@@ -686,11 +4638,12 @@ static int framework_probe(struct platform_device *pdev)
 
 	dev = &pdev->dev;
 
+	// cros_ec_lpcs may not have finished probing yet; we'll be probed
+	// again once it has
 	ec_device = bus_find_device(&platform_bus_type, NULL, NULL, device_match_cros_ec);
-	if (!ec_device) {
-		dev_err(dev, DRV_NAME ": failed to find EC %s.\n", FRAMEWORK_LAPTOP_EC_DEVICE_NAME);
-		return -EINVAL;
-	}
+	if (!ec_device)
+		return dev_err_probe(dev, -EPROBE_DEFER, DRV_NAME ": failed to find EC %s.\n",
+				     FRAMEWORK_LAPTOP_EC_DEVICE_NAME);
 	ec_device = ec_device->parent;
 
 	data = devm_kzalloc(dev, sizeof(*data), GFP_KERNEL);
@@ -699,12 +4652,9 @@ static int framework_probe(struct platform_device *pdev)
 
 	platform_set_drvdata(pdev, data);
 	data->pdev = pdev;
-
-	data->kb_led.name = DRV_NAME "::kbd_backlight";
-	data->kb_led.brightness_get = kb_led_get;
-	data->kb_led.brightness_set_blocking = kb_led_set;
-	data->kb_led.max_brightness = 100;
-	ret = devm_led_classdev_register(&pdev->dev, &data->kb_led);
+	framework_data_init(data);
+	framework_debugfs_init(data);
+	ret = devm_add_action_or_reset(dev, framework_debugfs_remove, data);
 	if (ret)
 		return ret;
 
@@ -725,27 +4675,25 @@ static int framework_probe(struct platform_device *pdev)
 #endif
 
 	struct cros_ec_device *ec = dev_get_drvdata(ec_device);
-	if (ec->cmd_readmem) {
-		// Count the number of fans
-		size_t fan_count;
-		if (ec_count_fans(&fan_count) < 0) {
-			dev_err(dev, DRV_NAME ": failed to count fans.\n");
-			return -EINVAL;
-		}
-		// NULL terminates the list after the last detected fan
-		fw_hwmon_attrs[fan_count * FW_ATTRS_PER_FAN] = NULL;
 
-		data->hwmon_dev = hwmon_device_register_with_groups(
-			dev, DRV_NAME, NULL, fw_hwmon_groups);
-		if (IS_ERR(data->hwmon_dev))
-			return PTR_ERR(data->hwmon_dev);
+	// Registered before the notifier, so it runs after the notifier is gone
+	ret = devm_add_action_or_reset(dev, framework_events_cancel, data);
+	if (ret)
+		return ret;
 
-	} else {
-		dev_err(dev, DRV_NAME ": fan readings could not be enabled for this EC %s.\n",
-		FRAMEWORK_LAPTOP_EC_DEVICE_NAME);
+	ret = blocking_notifier_chain_register(&ec->event_notifier,
+					       &data->ec_notifier);
+	if (ret) {
+		dev_err(dev, DRV_NAME ": failed to register EC event notifier.\n");
+		return ret;
 	}
+	ret = devm_add_action_or_reset(dev, framework_unregister_notifier, data);
+	if (ret)
+		return ret;
 
-	battery_hook_register(&framework_laptop_battery_hook);
+	// Nothing above has talked to the EC; the setup work does
+	fwdata = data;
+	queue_work(fw_wq, &data->setup_work);
 
 	return ret;
 }
@@ -760,11 +4708,30 @@ static int framework_remove(struct platform_device *pdev)
 
 	data = (struct framework_data *)platform_get_drvdata(pdev);
 
-	battery_hook_unregister(&framework_laptop_battery_hook);
+	if (data) {
+		cancel_work_sync(&data->resume_work);
+		cancel_work_sync(&data->setup_work);
+		if (data->battery_hooked)
+			battery_hook_unregister(&framework_laptop_battery_hook);
+		// No new opens after this; open files keep the ring alive
+		if (data->ring)
+			misc_deregister(&data->ring_misc);
+	}
 
 	// Make sure it's not null before we try to unregister it
-	if (data && data->hwmon_dev)
+	if (data && data->hwmon_dev) {
+		framework_poll_stop(data);
+		framework_cooling_unregister(data);
 		hwmon_device_unregister(data->hwmon_dev);
+		framework_curve_stop(data);
+		framework_fan_flush(data);
+	}
+
+	fwdata = NULL;
+
+	// The poller is stopped, so nothing writes to the ring any more
+	if (data && data->ring)
+		kref_put(&data->ring->ref, framework_ring_free);
 
 	put_device(ec_device);
 
@@ -774,12 +4741,64 @@ static int framework_remove(struct platform_device *pdev)
 	return 0;
 #endif
 }
+#endif
+
+static int framework_suspend(struct device *dev)
+{
+	struct framework_data *data = dev_get_drvdata(dev);
+
+	cancel_work_sync(&data->resume_work);
+	flush_work(&data->setup_work);
+	framework_poll_stop(data);
+
+	// Send anything still pending, then remember what each fan was last
+	// asked to do. Fans following a curve are left to the poller.
+	for (size_t i = 0; i < EC_FAN_SPEED_ENTRIES; i++) {
+		struct framework_fan *fan = &data->fans[i];
+
+		flush_delayed_work(&fan->work);
+
+		spin_lock(&fan->lock);
+		data->resume_fans_valid[i] = fan->has_sent &&
+					     !READ_ONCE(data->curves[i].enabled);
+		data->resume_fans[i] = fan->sent;
+		data->resume_fans[i].origin = "resume";
+		spin_unlock(&fan->lock);
+	}
+	// A running pattern picks up from its start on resume
+	hrtimer_cancel(&data->kb_timer);
+	flush_work(&data->kb_work);
+
+	return 0;
+}
+
+static int framework_resume(struct device *dev)
+{
+	struct framework_data *data = dev_get_drvdata(dev);
+
+	// The EC may have changed state while we were asleep. Readers get
+	// -ENODATA rather than pre-suspend values until the next poll.
+	fw_ec_cache_invalidate(data);
+	write_seqlock(&data->snapshot_lock);
+	data->snapshot.status = -ENODATA;
+	data->snapshot.battery_status = -ENODATA;
+	data->snapshot.power_status = -ENODATA;
+	write_sequnlock(&data->snapshot_lock);
+	queue_work(fw_wq, &data->resume_work);
+
+	return 0;
+}
+
+#ifndef FRAMEWORK_LAPTOP_KUNIT
+static DEFINE_SIMPLE_DEV_PM_OPS(framework_pm_ops, framework_suspend, framework_resume);
 
 static struct platform_driver framework_driver = {
 	.driver = {
 		.name = DRV_NAME,
 		.acpi_match_table = device_ids,
 		.dev_groups = framework_laptop_groups,
+		.pm = pm_sleep_ptr(&framework_pm_ops),
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
 	},
 	.probe = framework_probe,
 	.remove = framework_remove,
@@ -794,6 +4813,10 @@ static int __init framework_laptop_init(void)
 		return -ENODEV;
 	}
 
+	fw_wq = alloc_workqueue(DRV_NAME, WQ_UNBOUND | WQ_SYSFS, 0);
+	if (!fw_wq)
+		return -ENOMEM;
+
 	ret = platform_driver_register(&framework_driver);
 	if (ret)
 		goto fail;
@@ -819,6 +4842,7 @@ fail_platform_driver:
 	platform_driver_unregister(&framework_driver);
 
 fail:
+	destroy_workqueue(fw_wq);
 	return ret;
 }
 
@@ -829,6 +4853,7 @@ static void __exit framework_laptop_exit(void)
 		platform_device_unregister(fwdevice);
 		platform_driver_unregister(&framework_driver);
 	}
+	destroy_workqueue(fw_wq);
 }
 
 module_init(framework_laptop_init);
@@ -839,3 +4864,4 @@ MODULE_AUTHOR("Dustin L. Howett <dustin@howett.net>");
 MODULE_LICENSE("GPL");
 MODULE_ALIAS("platform:" DRV_NAME);
 MODULE_SOFTDEP("pre: cros_ec_lpcs");
+#endif
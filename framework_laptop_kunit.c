@@ -0,0 +1,930 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * KUnit tests for the Framework Laptop ACPI Driver
+ *
+ * The driver is built into this module with a fake cros_ec_device in place
+ * of the real EC, which answers the host commands and memory map reads the
+ * tested paths use. The fake can add latency to every transaction and fail
+ * every n-th one, and counts what it was sent.
+ *
+ * Load framework_laptop_kunit.ko with the real driver unloaded; the results
+ * are in the kernel log and under /sys/kernel/debug/kunit/framework_laptop/.
+ */
+
+#define FRAMEWORK_LAPTOP_KUNIT
+#include "framework_laptop.c"
+
+#include <kunit/test.h>
+#include <linux/delay.h>
+#include <linux/device.h>
+
+// --- fake EC ---
+// Host commands the fake answers, besides EC_CMD_GET_CMD_VERSIONS, and the
+// versions it reports for them. Anything else gets EC_RES_INVALID_COMMAND,
+// and the driver is told it isn't there.
+static const struct {
+	u16 command;
+	u32 versions;
+} fw_fake_commands[] = {
+	{ EC_CMD_CHARGE_LIMIT_CONTROL, EC_VER_MASK(0) },
+	{ EC_CMD_PWM_GET_DUTY, EC_VER_MASK(0) },
+	{ EC_CMD_PWM_SET_KEYBOARD_BACKLIGHT, EC_VER_MASK(0) },
+	{ EC_CMD_PWM_SET_FAN_DUTY, EC_VER_MASK(0) | EC_VER_MASK(1) },
+	{ EC_CMD_PWM_SET_FAN_TARGET_RPM, EC_VER_MASK(0) | EC_VER_MASK(1) },
+	{ EC_CMD_THERMAL_AUTO_FAN_CTRL, EC_VER_MASK(0) | EC_VER_MASK(1) },
+};
+
+struct fw_fake_ec {
+	struct cros_ec_device ec;
+	struct device *dev;
+	spinlock_t lock;
+	// Added to every host command or memory map read
+	unsigned int cmd_latency_us;
+	unsigned int readmem_latency_us;
+	// Fail every n-th host command or memory map read with -EIO, 0 for never
+	unsigned int cmd_fail_every;
+	unsigned int readmem_fail_every;
+	u64 xfers;
+	u64 readmems;
+	u64 calls[ARRAY_SIZE(fw_fake_commands)];
+	u8 memmap[EC_MEMMAP_SIZE];
+	u8 charge_limit;
+	u8 kb_percent;
+	// What each fan was last told
+	bool fan_auto[EC_FAN_SPEED_ENTRIES];
+	u32 fan_duty[EC_FAN_SPEED_ENTRIES];
+	u32 fan_rpm[EC_FAN_SPEED_ENTRIES];
+};
+
+static int fw_fake_index(u16 command)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(fw_fake_commands); i++) {
+		if (fw_fake_commands[i].command == command)
+			return i;
+	}
+
+	return -1;
+}
+
+// Called by cros_ec_cmd_xfer() with ec->lock held, as for a protocol v2 EC
+static int fw_fake_cmd_xfer(struct cros_ec_device *ec,
+			    struct cros_ec_command *msg)
+{
+	struct fw_fake_ec *fake = container_of(ec, struct fw_fake_ec, ec);
+	int idx = fw_fake_index(msg->command);
+	int ret = msg->insize;
+
+	if (fake->cmd_latency_us)
+		fsleep(fake->cmd_latency_us);
+
+	spin_lock(&fake->lock);
+	fake->xfers++;
+	if (idx >= 0)
+		fake->calls[idx]++;
+	if (fake->cmd_fail_every && fake->xfers % fake->cmd_fail_every == 0) {
+		spin_unlock(&fake->lock);
+		return -EIO;
+	}
+
+	msg->result = EC_RES_SUCCESS;
+	switch (msg->command) {
+	case EC_CMD_GET_CMD_VERSIONS: {
+		struct ec_params_get_cmd_versions_v1 *p = (void *)msg->data;
+		struct ec_response_get_cmd_versions *r = (void *)msg->data;
+
+		int cmd = fw_fake_index(p->cmd);
+
+		if (cmd < 0)
+			msg->result = EC_RES_INVALID_PARAM;
+		else
+			r->version_mask = fw_fake_commands[cmd].versions;
+		break;
+	}
+	case EC_CMD_CHARGE_LIMIT_CONTROL: {
+		struct ec_params_ec_chg_limit_control *p = (void *)msg->data;
+		struct ec_response_chg_limit_control *r = (void *)msg->data;
+
+		if (p->modes & CHG_LIMIT_SET_LIMIT)
+			fake->charge_limit = p->max_percentage;
+		r->max_percentage = fake->charge_limit;
+		r->min_percentage = 0;
+		break;
+	}
+	case EC_CMD_PWM_GET_DUTY: {
+		struct ec_params_pwm_get_duty *p = (void *)msg->data;
+		struct ec_response_pwm_get_duty *r = (void *)msg->data;
+
+		if (p->pwm_type != EC_PWM_TYPE_KB_LIGHT) {
+			msg->result = EC_RES_INVALID_PARAM;
+			break;
+		}
+		// Rounded up, so that the driver's percentage comes out exact
+		r->duty = DIV_ROUND_UP(fake->kb_percent * EC_PWM_MAX_DUTY, 100);
+		break;
+	}
+	case EC_CMD_PWM_SET_KEYBOARD_BACKLIGHT: {
+		struct ec_params_pwm_set_keyboard_backlight *p = (void *)msg->data;
+
+		fake->kb_percent = p->percent;
+		break;
+	}
+	// v0 of the fan commands is v1 without the fan index, so for fan 0
+	case EC_CMD_PWM_SET_FAN_DUTY: {
+		struct ec_params_pwm_set_fan_duty_v1 *p = (void *)msg->data;
+		u8 fan = msg->version ? p->fan_idx : 0;
+
+		if (fan >= EC_FAN_SPEED_ENTRIES) {
+			msg->result = EC_RES_INVALID_PARAM;
+			break;
+		}
+		fake->fan_auto[fan] = false;
+		fake->fan_duty[fan] = p->percent;
+		break;
+	}
+	case EC_CMD_PWM_SET_FAN_TARGET_RPM: {
+		struct ec_params_pwm_set_fan_target_rpm_v1 *p = (void *)msg->data;
+		u8 fan = msg->version ? p->fan_idx : 0;
+
+		if (fan >= EC_FAN_SPEED_ENTRIES) {
+			msg->result = EC_RES_INVALID_PARAM;
+			break;
+		}
+		fake->fan_auto[fan] = false;
+		fake->fan_rpm[fan] = p->rpm;
+		break;
+	}
+	case EC_CMD_THERMAL_AUTO_FAN_CTRL: {
+		struct ec_params_auto_fan_ctrl_v1 *p = (void *)msg->data;
+		u8 fan = msg->version ? p->fan_idx : 0;
+
+		if (fan >= EC_FAN_SPEED_ENTRIES) {
+			msg->result = EC_RES_INVALID_PARAM;
+			break;
+		}
+		fake->fan_auto[fan] = true;
+		break;
+	}
+	default:
+		msg->result = EC_RES_INVALID_COMMAND;
+		break;
+	}
+	spin_unlock(&fake->lock);
+
+	return ret;
+}
+
+static int fw_fake_cmd_readmem(struct cros_ec_device *ec, unsigned int offset,
+			       unsigned int bytes, void *dest)
+{
+	struct fw_fake_ec *fake = container_of(ec, struct fw_fake_ec, ec);
+
+	if (offset + bytes > EC_MEMMAP_SIZE)
+		return -EINVAL;
+
+	if (fake->readmem_latency_us)
+		fsleep(fake->readmem_latency_us);
+
+	spin_lock(&fake->lock);
+	fake->readmems++;
+	if (fake->readmem_fail_every &&
+	    fake->readmems % fake->readmem_fail_every == 0) {
+		spin_unlock(&fake->lock);
+		return -EIO;
+	}
+	memcpy(dest, fake->memmap + offset, bytes);
+	spin_unlock(&fake->lock);
+
+	return bytes;
+}
+
+static void fw_fake_set_fans(struct fw_fake_ec *fake,
+			     const u16 fans[EC_FAN_SPEED_ENTRIES])
+{
+	spin_lock(&fake->lock);
+	memcpy(fake->memmap + EC_MEMMAP_FAN, fans,
+	       EC_FAN_SPEED_ENTRIES * sizeof(*fans));
+	spin_unlock(&fake->lock);
+}
+
+static u64 fw_fake_calls(struct fw_fake_ec *fake, u16 command)
+{
+	u64 calls;
+
+	spin_lock(&fake->lock);
+	calls = fake->calls[fw_fake_index(command)];
+	spin_unlock(&fake->lock);
+
+	return calls;
+}
+
+// --- fixture ---
+struct fw_test {
+	struct fw_fake_ec fake;
+	struct framework_data data;
+	// Stands in for the platform device, with data as its driver data
+	struct device *dev;
+	bool stop;
+};
+
+// Host commands and memory map reads the driver has made, from fw_ec_stats
+static u64 fw_test_ec_calls(struct framework_data *data)
+{
+	u64 calls = 0;
+
+	spin_lock(&data->stats_lock);
+	for (size_t i = 0; i < FW_STATS_ENTRIES; i++)
+		calls += data->stats[i].calls;
+	spin_unlock(&data->stats_lock);
+
+	return calls;
+}
+
+// What framework_probe() and the setup work do, short of registering
+// anything with other subsystems
+static int fw_test_data_init(struct fw_test *t)
+{
+	struct framework_data *data = &t->data;
+	int ret;
+
+	framework_data_init(data);
+	framework_debugfs_init(data);
+
+	// As the driver core would for dev_groups
+	dev_set_drvdata(t->dev, data);
+	ret = device_add_groups(t->dev, framework_laptop_groups);
+	if (ret) {
+		framework_debugfs_remove(data);
+		return ret;
+	}
+
+	ret = blocking_notifier_chain_register(&t->fake.ec.event_notifier,
+					       &data->ec_notifier);
+	if (ret) {
+		device_remove_groups(t->dev, framework_laptop_groups);
+		framework_debugfs_remove(data);
+		return ret;
+	}
+
+	fw_ec_probe_caps(data);
+	ret = ec_get_kb_led(data, "kunit");
+	data->kb_sent = ret;
+	data->kb_brightness = max(ret, 0);
+	fwdata = data;
+
+	return 0;
+}
+
+// What framework_remove() and the devm actions undo
+static void fw_test_data_exit(struct fw_test *t)
+{
+	struct framework_data *data = &t->data;
+
+	fwdata = NULL;
+	cancel_work_sync(&data->resume_work);
+	framework_poll_stop(data);
+	framework_cooling_unregister(data);
+	framework_curve_stop(data);
+	framework_fan_flush(data);
+	cancel_work_sync(&data->kb_work);
+	framework_unregister_notifier(data);
+	framework_events_cancel(data);
+	device_remove_groups(t->dev, framework_laptop_groups);
+	framework_debugfs_remove(data);
+}
+
+static int fw_test_init(struct kunit *test)
+{
+	static const u16 fans[EC_FAN_SPEED_ENTRIES] = {
+		2000, EC_FAN_SPEED_NOT_PRESENT, EC_FAN_SPEED_NOT_PRESENT,
+		EC_FAN_SPEED_NOT_PRESENT,
+	};
+	struct fw_test *t;
+	struct fw_fake_ec *fake;
+	int ret;
+
+	t = kunit_kzalloc(test, sizeof(*t), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, t);
+	fake = &t->fake;
+
+	fw_wq = alloc_workqueue(DRV_NAME "_kunit", WQ_UNBOUND, 0);
+	KUNIT_ASSERT_NOT_NULL(test, fw_wq);
+
+	fake->dev = root_device_register(DRV_NAME "_kunit_ec");
+	if (IS_ERR(fake->dev)) {
+		destroy_workqueue(fw_wq);
+		KUNIT_ASSERT_NOT_ERR_OR_NULL(test, fake->dev);
+	}
+
+	t->dev = root_device_register(DRV_NAME "_kunit");
+	if (IS_ERR(t->dev)) {
+		root_device_unregister(fake->dev);
+		destroy_workqueue(fw_wq);
+		KUNIT_ASSERT_NOT_ERR_OR_NULL(test, t->dev);
+	}
+
+	spin_lock_init(&fake->lock);
+	fake->charge_limit = 80;
+	fake->kb_percent = 40;
+	fw_fake_set_fans(fake, fans);
+
+	mutex_init(&fake->ec.lock);
+	fake->ec.dev = fake->dev;
+	fake->ec.proto_version = 2;
+	fake->ec.max_request = EC_PROTO2_MAX_PARAM_SIZE;
+	fake->ec.max_response = EC_PROTO2_MAX_PARAM_SIZE;
+	fake->ec.cmd_xfer = fw_fake_cmd_xfer;
+	fake->ec.cmd_readmem = fw_fake_cmd_readmem;
+	BLOCKING_INIT_NOTIFIER_HEAD(&fake->ec.event_notifier);
+	dev_set_drvdata(fake->dev, &fake->ec);
+	ec_device = fake->dev;
+
+	ret = fw_test_data_init(t);
+	if (ret) {
+		ec_device = NULL;
+		root_device_unregister(t->dev);
+		root_device_unregister(fake->dev);
+		destroy_workqueue(fw_wq);
+		KUNIT_ASSERT_EQ(test, ret, 0);
+	}
+	// Only set once there is something for fw_test_exit() to undo
+	test->priv = t;
+
+	return 0;
+}
+
+static void fw_test_exit(struct kunit *test)
+{
+	struct fw_test *t = test->priv;
+
+	if (!t)
+		return;
+
+	fw_test_data_exit(t);
+	destroy_workqueue(fw_wq);
+	fw_wq = NULL;
+	ec_device = NULL;
+	root_device_unregister(t->dev);
+	root_device_unregister(t->fake.dev);
+}
+
+// --- tests ---
+static void fw_test_caps(struct kunit *test)
+{
+	struct fw_test *t = test->priv;
+
+	KUNIT_EXPECT_TRUE(test, fw_ec_has(&t->data, FW_CAP_CHARGE_LIMIT, 0));
+	KUNIT_EXPECT_TRUE(test, fw_ec_has(&t->data, FW_CAP_KB_LED_SET, 0));
+	KUNIT_EXPECT_FALSE(test, fw_ec_has(&t->data, FW_CAP_POWER_INFO, 0));
+	KUNIT_EXPECT_FALSE(test, fw_ec_supported(&t->data, EC_CMD_POWER_INFO, 0));
+	KUNIT_EXPECT_EQ(test, fw_fan_cmd_version(&t->data, FW_CAP_FAN_DUTY), 1);
+	KUNIT_EXPECT_EQ(test, t->data.kb_sent, 40);
+}
+
+static void fw_test_charge_limit(struct kunit *test)
+{
+	struct fw_test *t = test->priv;
+	struct framework_data *data = &t->data;
+	u64 calls = fw_fake_calls(&t->fake, EC_CMD_CHARGE_LIMIT_CONTROL);
+
+	KUNIT_EXPECT_EQ(test, charge_limit_control(data, CHG_LIMIT_GET_LIMIT, 0, "kunit"), 80);
+	KUNIT_EXPECT_EQ(test, READ_ONCE(data->charge_limit_seen), 80);
+	// The second read is answered from the cache
+	KUNIT_EXPECT_EQ(test, charge_limit_control(data, CHG_LIMIT_GET_LIMIT, 0, "kunit"), 80);
+	KUNIT_EXPECT_EQ(test, fw_fake_calls(&t->fake, EC_CMD_CHARGE_LIMIT_CONTROL),
+			calls + 1);
+
+	// A write always goes to the EC, and drops the cached read
+	KUNIT_EXPECT_EQ(test, charge_limit_control(data, CHG_LIMIT_SET_LIMIT, 60, "kunit"), 60);
+	KUNIT_EXPECT_EQ(test, t->fake.charge_limit, 60);
+	KUNIT_EXPECT_EQ(test, READ_ONCE(data->charge_limit_seen), 60);
+	KUNIT_EXPECT_EQ(test, charge_limit_control(data, CHG_LIMIT_GET_LIMIT, 0, "kunit"), 60);
+	KUNIT_EXPECT_EQ(test, fw_fake_calls(&t->fake, EC_CMD_CHARGE_LIMIT_CONTROL),
+			calls + 3);
+}
+
+static void fw_test_charge_limit_error(struct kunit *test)
+{
+	struct fw_test *t = test->priv;
+	struct framework_data *data = &t->data;
+
+	t->fake.cmd_fail_every = 1;
+	KUNIT_EXPECT_EQ(test, charge_limit_control(data, CHG_LIMIT_GET_LIMIT, 0, "kunit"), -EIO);
+	KUNIT_EXPECT_EQ(test, charge_limit_control(data, CHG_LIMIT_SET_LIMIT, 60, "kunit"), -EIO);
+	KUNIT_EXPECT_EQ(test, READ_ONCE(data->charge_limit_seen), -1);
+
+	// Failures aren't cached
+	t->fake.cmd_fail_every = 0;
+	KUNIT_EXPECT_EQ(test, charge_limit_control(data, CHG_LIMIT_GET_LIMIT, 0, "kunit"), 80);
+}
+
+static void fw_test_kb_led(struct kunit *test)
+{
+	struct fw_test *t = test->priv;
+	struct framework_data *data = &t->data;
+	u64 calls;
+
+	KUNIT_EXPECT_EQ(test, kb_led_get(&data->kb_led), 40);
+	KUNIT_EXPECT_EQ(test, ec_get_kb_led(data, "kunit"), 40);
+
+	calls = fw_fake_calls(&t->fake, EC_CMD_PWM_SET_KEYBOARD_BACKLIGHT);
+	kb_led_set(&data->kb_led, 70);
+	// Reported straight away, before the EC has it
+	KUNIT_EXPECT_EQ(test, kb_led_get(&data->kb_led), 70);
+	flush_work(&data->kb_work);
+	KUNIT_EXPECT_EQ(test, t->fake.kb_percent, 70);
+	KUNIT_EXPECT_EQ(test, ec_get_kb_led(data, "kunit"), 70);
+
+	// Setting what was last sent doesn't bother the EC
+	kb_led_set(&data->kb_led, 70);
+	flush_work(&data->kb_work);
+	KUNIT_EXPECT_EQ(test, fw_fake_calls(&t->fake, EC_CMD_PWM_SET_KEYBOARD_BACKLIGHT),
+			calls + 1);
+}
+
+// Writes that arrive while one is on its way are folded into the next one
+static void fw_test_kb_led_coalesce(struct kunit *test)
+{
+	struct fw_test *t = test->priv;
+	struct framework_data *data = &t->data;
+	u64 calls = fw_fake_calls(&t->fake, EC_CMD_PWM_SET_KEYBOARD_BACKLIGHT);
+
+	t->fake.cmd_latency_us = 20000;
+	for (int i = 1; i <= 10; i++)
+		kb_led_set(&data->kb_led, i * 10);
+	flush_work(&data->kb_work);
+
+	KUNIT_EXPECT_EQ(test, t->fake.kb_percent, 100);
+	KUNIT_EXPECT_EQ(test, kb_led_get(&data->kb_led), 100);
+	KUNIT_EXPECT_LE(test, fw_fake_calls(&t->fake, EC_CMD_PWM_SET_KEYBOARD_BACKLIGHT),
+			calls + 2);
+}
+
+static void fw_test_kb_led_error(struct kunit *test)
+{
+	struct fw_test *t = test->priv;
+	struct framework_data *data = &t->data;
+
+	t->fake.cmd_fail_every = 1;
+	kb_led_set(&data->kb_led, 70);
+	flush_work(&data->kb_work);
+	KUNIT_EXPECT_EQ(test, t->fake.kb_percent, 40);
+	KUNIT_EXPECT_EQ(test, data->kb_sent, -1);
+	KUNIT_EXPECT_EQ(test, ec_get_kb_led(data, "kunit"), -EIO);
+
+	// The same value is sent again, since the EC never took it
+	t->fake.cmd_fail_every = 0;
+	kb_led_set(&data->kb_led, 70);
+	flush_work(&data->kb_work);
+	KUNIT_EXPECT_EQ(test, t->fake.kb_percent, 70);
+	KUNIT_EXPECT_EQ(test, data->kb_sent, 70);
+}
+
+static void fw_test_count_fans(struct kunit *test)
+{
+	static const u16 fans[EC_FAN_SPEED_ENTRIES] = {
+		1200, EC_FAN_SPEED_NOT_PRESENT, EC_FAN_SPEED_STALLED,
+		EC_FAN_SPEED_NOT_PRESENT,
+	};
+	struct fw_test *t = test->priv;
+	struct framework_data *data = &t->data;
+	size_t count;
+
+	// Nothing to count before the first snapshot
+	KUNIT_EXPECT_EQ(test, ec_count_fans(data, &count), -EIO);
+
+	fw_fake_set_fans(&t->fake, fans);
+	framework_update_snapshot(data, "kunit");
+	KUNIT_EXPECT_EQ(test, ec_count_fans(data, &count), 0);
+	KUNIT_EXPECT_EQ(test, count, 2);
+	KUNIT_EXPECT_EQ(test, data->fan_mask, BIT(0) | BIT(2));
+
+	t->fake.readmem_fail_every = 1;
+	framework_update_snapshot(data, "kunit");
+	KUNIT_EXPECT_EQ(test, ec_count_fans(data, &count), -EIO);
+}
+
+static void fw_test_fan_read(struct kunit *test)
+{
+	static const u16 fans[EC_FAN_SPEED_ENTRIES] = {
+		1200, EC_FAN_SPEED_NOT_PRESENT, EC_FAN_SPEED_STALLED,
+		EC_FAN_SPEED_NOT_PRESENT,
+	};
+	struct fw_test *t = test->priv;
+	struct framework_data *data = &t->data;
+	u64 readmems;
+	long val;
+
+	fw_fake_set_fans(&t->fake, fans);
+	framework_update_snapshot(data, "kunit");
+
+	// Reads come from the snapshot, without touching the EC
+	readmems = t->fake.readmems;
+	KUNIT_EXPECT_EQ(test, fw_fan_read(data, hwmon_fan_input, 0, &val), 0);
+	KUNIT_EXPECT_EQ(test, val, 1200);
+	KUNIT_EXPECT_EQ(test, fw_fan_read(data, hwmon_fan_input, 2, &val), 0);
+	KUNIT_EXPECT_EQ(test, val, 0);
+	KUNIT_EXPECT_EQ(test, fw_fan_read(data, hwmon_fan_alarm, 2, &val), 0);
+	KUNIT_EXPECT_EQ(test, val, 1);
+	KUNIT_EXPECT_EQ(test, fw_fan_read(data, hwmon_fan_fault, 1, &val), 0);
+	KUNIT_EXPECT_EQ(test, val, 1);
+	KUNIT_EXPECT_EQ(test, fw_fan_read(data, hwmon_fan_fault, 0, &val), 0);
+	KUNIT_EXPECT_EQ(test, val, 0);
+	KUNIT_EXPECT_EQ(test, t->fake.readmems, readmems);
+
+	t->fake.readmem_fail_every = 1;
+	framework_update_snapshot(data, "kunit");
+	KUNIT_EXPECT_EQ(test, fw_fan_read(data, hwmon_fan_input, 0, &val), -EIO);
+}
+
+static int fw_test_fan_error(struct framework_data *data, u8 idx)
+{
+	struct framework_fan *fan = &data->fans[idx];
+	int error;
+
+	spin_lock(&fan->lock);
+	error = fan->error;
+	spin_unlock(&fan->lock);
+
+	return error;
+}
+
+// Requests that arrive while one is on its way replace each other, and only
+// the newest is sent after it
+static void fw_test_fan_coalesce(struct kunit *test)
+{
+	struct fw_test *t = test->priv;
+	struct framework_data *data = &t->data;
+	u64 calls = fw_fake_calls(&t->fake, EC_CMD_PWM_SET_FAN_DUTY);
+
+	t->fake.cmd_latency_us = 20000;
+	for (int i = 1; i <= 10; i++)
+		framework_fan_request(data, 1, FW_FAN_MODE_DUTY, i * 10, "kunit");
+	flush_delayed_work(&data->fans[1].work);
+
+	KUNIT_EXPECT_EQ(test, t->fake.fan_duty[1], 100);
+	KUNIT_EXPECT_FALSE(test, t->fake.fan_auto[1]);
+	KUNIT_EXPECT_EQ(test, fw_test_fan_error(data, 1), 0);
+	KUNIT_EXPECT_LE(test, fw_fake_calls(&t->fake, EC_CMD_PWM_SET_FAN_DUTY),
+			calls + 2);
+	// The other fans weren't touched
+	KUNIT_EXPECT_EQ(test, t->fake.fan_duty[0], 0);
+
+	// Asking for what was last sent doesn't bother the EC
+	calls = fw_fake_calls(&t->fake, EC_CMD_PWM_SET_FAN_DUTY);
+	framework_fan_request(data, 1, FW_FAN_MODE_DUTY, 100, "kunit");
+	flush_delayed_work(&data->fans[1].work);
+	KUNIT_EXPECT_EQ(test, fw_fake_calls(&t->fake, EC_CMD_PWM_SET_FAN_DUTY), calls);
+
+	// A different mode is always sent
+	framework_fan_request(data, 1, FW_FAN_MODE_AUTO, 0, "kunit");
+	flush_delayed_work(&data->fans[1].work);
+	KUNIT_EXPECT_TRUE(test, t->fake.fan_auto[1]);
+}
+
+static void fw_test_fan_request_error(struct kunit *test)
+{
+	struct fw_test *t = test->priv;
+	struct framework_data *data = &t->data;
+
+	t->fake.cmd_fail_every = 1;
+	framework_fan_request(data, 0, FW_FAN_MODE_DUTY, 50, "kunit");
+	flush_delayed_work(&data->fans[0].work);
+	KUNIT_EXPECT_EQ(test, fw_test_fan_error(data, 0), -EIO);
+	KUNIT_EXPECT_EQ(test, t->fake.fan_duty[0], 0);
+	KUNIT_EXPECT_FALSE(test, data->fans[0].has_sent);
+
+	// The same request goes out again, since the EC never took it
+	t->fake.cmd_fail_every = 0;
+	framework_fan_request(data, 0, FW_FAN_MODE_DUTY, 50, "kunit");
+	flush_delayed_work(&data->fans[0].work);
+	KUNIT_EXPECT_EQ(test, fw_test_fan_error(data, 0), 0);
+	KUNIT_EXPECT_EQ(test, t->fake.fan_duty[0], 50);
+}
+
+// An EC event drops cached responses, since the EC may have changed them
+static void fw_test_ec_event(struct kunit *test)
+{
+	struct fw_test *t = test->priv;
+	struct framework_data *data = &t->data;
+	u64 calls = fw_fake_calls(&t->fake, EC_CMD_CHARGE_LIMIT_CONTROL);
+
+	KUNIT_EXPECT_EQ(test, charge_limit_control(data, CHG_LIMIT_GET_LIMIT, 0, "kunit"), 80);
+	// Changed on the EC's side, which the cache can't know about
+	t->fake.charge_limit = 90;
+	KUNIT_EXPECT_EQ(test, charge_limit_control(data, CHG_LIMIT_GET_LIMIT, 0, "kunit"), 80);
+	KUNIT_EXPECT_EQ(test, fw_fake_calls(&t->fake, EC_CMD_CHARGE_LIMIT_CONTROL),
+			calls + 1);
+
+	blocking_notifier_call_chain(&t->fake.ec.event_notifier, 0, &t->fake.ec);
+	KUNIT_EXPECT_EQ(test, charge_limit_control(data, CHG_LIMIT_GET_LIMIT, 0, "kunit"), 90);
+	KUNIT_EXPECT_EQ(test, fw_fake_calls(&t->fake, EC_CMD_CHARGE_LIMIT_CONTROL),
+			calls + 2);
+}
+
+// Nothing read before suspend is trusted after resume
+static void fw_test_resume(struct kunit *test)
+{
+	struct fw_test *t = test->priv;
+	struct framework_data *data = &t->data;
+	struct framework_snapshot snap;
+	u64 calls = fw_fake_calls(&t->fake, EC_CMD_CHARGE_LIMIT_CONTROL);
+
+	framework_update_snapshot(data, "kunit");
+	KUNIT_EXPECT_EQ(test, charge_limit_control(data, CHG_LIMIT_GET_LIMIT, 0, "kunit"), 80);
+
+	KUNIT_ASSERT_EQ(test, framework_suspend(t->dev), 0);
+	t->fake.charge_limit = 90;
+	KUNIT_ASSERT_EQ(test, framework_resume(t->dev), 0);
+
+	framework_read_snapshot(data, &snap);
+	KUNIT_EXPECT_EQ(test, snap.status, -ENODATA);
+	KUNIT_EXPECT_EQ(test, snap.battery_status, -ENODATA);
+	KUNIT_EXPECT_EQ(test, snap.power_status, -ENODATA);
+
+	// Nothing was set through the driver, so there's nothing to put back
+	flush_work(&data->resume_work);
+	KUNIT_EXPECT_EQ(test, fw_fake_calls(&t->fake, EC_CMD_CHARGE_LIMIT_CONTROL),
+			calls + 1);
+	KUNIT_EXPECT_EQ(test, charge_limit_control(data, CHG_LIMIT_GET_LIMIT, 0, "kunit"), 90);
+	KUNIT_EXPECT_EQ(test, fw_fake_calls(&t->fake, EC_CMD_CHARGE_LIMIT_CONTROL),
+			calls + 2);
+}
+
+// What was set through the driver is sent again on resume
+static void fw_test_resume_restore(struct kunit *test)
+{
+	struct fw_test *t = test->priv;
+	struct framework_data *data = &t->data;
+
+	KUNIT_ASSERT_EQ(test, battery_set_threshold("60", 2), 2);
+	framework_fan_request(data, 0, FW_FAN_MODE_DUTY, 50, "kunit");
+
+	// Sends the pending fan request before going to sleep
+	KUNIT_ASSERT_EQ(test, framework_suspend(t->dev), 0);
+	KUNIT_EXPECT_EQ(test, t->fake.fan_duty[0], 50);
+
+	// The EC was reset while asleep
+	t->fake.charge_limit = 100;
+	t->fake.fan_duty[0] = 0;
+	t->fake.fan_auto[0] = true;
+	KUNIT_ASSERT_EQ(test, framework_resume(t->dev), 0);
+	flush_work(&data->resume_work);
+
+	KUNIT_EXPECT_EQ(test, t->fake.charge_limit, 60);
+	KUNIT_EXPECT_EQ(test, t->fake.fan_duty[0], 50);
+	KUNIT_EXPECT_FALSE(test, t->fake.fan_auto[0]);
+	KUNIT_EXPECT_EQ(test, fw_test_fan_error(data, 0), 0);
+}
+
+// --- concurrent readers ---
+#define FW_TEST_READERS 8
+#define FW_TEST_READS 100
+
+struct fw_test_reader {
+	struct work_struct work;
+	struct fw_test *t;
+	int bad;
+};
+
+static void fw_test_run_readers(struct fw_test *t, struct fw_test_reader *r,
+				work_func_t fn)
+{
+	for (size_t i = 0; i < FW_TEST_READERS; i++) {
+		r[i].t = t;
+		INIT_WORK(&r[i].work, fn);
+		queue_work(fw_wq, &r[i].work);
+	}
+}
+
+static int fw_test_wait_readers(struct fw_test_reader *r)
+{
+	int bad = 0;
+
+	for (size_t i = 0; i < FW_TEST_READERS; i++) {
+		flush_work(&r[i].work);
+		bad += r[i].bad;
+	}
+
+	return bad;
+}
+
+static void fw_test_charge_limit_reader(struct work_struct *work)
+{
+	struct fw_test_reader *r = container_of(work, struct fw_test_reader, work);
+
+	for (int i = 0; i < FW_TEST_READS; i++) {
+		if (charge_limit_control(&r->t->data, CHG_LIMIT_GET_LIMIT, 0, "kunit") != 80)
+			r->bad++;
+	}
+}
+
+// Readers that miss the cache together share a single host command
+static void fw_test_concurrent_charge_limit(struct kunit *test)
+{
+	struct fw_test *t = test->priv;
+	struct fw_test_reader *r;
+	u64 calls = fw_fake_calls(&t->fake, EC_CMD_CHARGE_LIMIT_CONTROL);
+
+	r = kunit_kcalloc(test, FW_TEST_READERS, sizeof(*r), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, r);
+
+	t->fake.cmd_latency_us = 2000;
+	fw_test_run_readers(t, r, fw_test_charge_limit_reader);
+	KUNIT_EXPECT_EQ(test, fw_test_wait_readers(r), 0);
+	KUNIT_EXPECT_EQ(test, fw_fake_calls(&t->fake, EC_CMD_CHARGE_LIMIT_CONTROL),
+			calls + 1);
+}
+
+static void fw_test_charge_limit_racer(struct work_struct *work)
+{
+	struct fw_test_reader *r = container_of(work, struct fw_test_reader, work);
+	int ret;
+
+	while (!READ_ONCE(r->t->stop)) {
+		ret = charge_limit_control(&r->t->data, CHG_LIMIT_GET_LIMIT, 0, "kunit");
+		if (ret != 60 && ret != 70)
+			r->bad++;
+	}
+}
+
+// Reads racing with writes only ever see a limit that was set
+static void fw_test_concurrent_charge_limit_set(struct kunit *test)
+{
+	struct fw_test *t = test->priv;
+	struct framework_data *data = &t->data;
+	struct fw_test_reader *r;
+
+	r = kunit_kcalloc(test, FW_TEST_READERS, sizeof(*r), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, r);
+
+	KUNIT_ASSERT_EQ(test, charge_limit_control(data, CHG_LIMIT_SET_LIMIT, 60, "kunit"), 60);
+	t->fake.cmd_latency_us = 100;
+	fw_test_run_readers(t, r, fw_test_charge_limit_racer);
+	for (int i = 0; i < FW_TEST_READS; i++)
+		charge_limit_control(data, CHG_LIMIT_SET_LIMIT, i % 2 ? 60 : 70, "kunit");
+	WRITE_ONCE(t->stop, true);
+	KUNIT_EXPECT_EQ(test, fw_test_wait_readers(r), 0);
+
+	// Nothing stale survives the last write
+	KUNIT_EXPECT_EQ(test, charge_limit_control(data, CHG_LIMIT_GET_LIMIT, 0, "kunit"), 60);
+}
+
+static void fw_test_snapshot_reader(struct work_struct *work)
+{
+	struct fw_test_reader *r = container_of(work, struct fw_test_reader, work);
+	struct framework_snapshot snap;
+
+	while (!READ_ONCE(r->t->stop)) {
+		framework_read_snapshot(&r->t->data, &snap);
+		if (snap.status < 0)
+			continue;
+		for (size_t i = 1; i < EC_FAN_SPEED_ENTRIES; i++) {
+			if (snap.fans[i] != snap.fans[0])
+				r->bad++;
+		}
+	}
+}
+
+// A snapshot is never seen half written
+static void fw_test_concurrent_snapshot(struct kunit *test)
+{
+	static const u16 slow[EC_FAN_SPEED_ENTRIES] = { 1000, 1000, 1000, 1000 };
+	static const u16 fast[EC_FAN_SPEED_ENTRIES] = { 3000, 3000, 3000, 3000 };
+	struct fw_test *t = test->priv;
+	struct fw_test_reader *r;
+	size_t count;
+
+	r = kunit_kcalloc(test, FW_TEST_READERS, sizeof(*r), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, r);
+
+	fw_test_run_readers(t, r, fw_test_snapshot_reader);
+	for (int i = 0; i < FW_TEST_READS * 10; i++) {
+		fw_fake_set_fans(&t->fake, i % 2 ? slow : fast);
+		framework_update_snapshot(&t->data, "kunit");
+		if (ec_count_fans(&t->data, &count) < 0 || count != 4)
+			KUNIT_FAIL(test, "counted %zu fans", count);
+	}
+	WRITE_ONCE(t->stop, true);
+	KUNIT_EXPECT_EQ(test, fw_test_wait_readers(r), 0);
+}
+
+// --- benchmarks ---
+// Time each path against an EC that takes as long as a typical LPC one, and
+// count the EC transactions it makes per call
+#define FW_BENCH_ITERATIONS 200
+
+static void fw_bench_charge_limit_get(struct framework_data *data, int i)
+{
+	charge_limit_control(data, CHG_LIMIT_GET_LIMIT, 0, "kunit");
+}
+
+static void fw_bench_charge_limit_set(struct framework_data *data, int i)
+{
+	charge_limit_control(data, CHG_LIMIT_SET_LIMIT, i % 2 ? 60 : 70, "kunit");
+}
+
+static void fw_bench_kb_led_get(struct framework_data *data, int i)
+{
+	kb_led_get(&data->kb_led);
+}
+
+static void fw_bench_kb_led_set(struct framework_data *data, int i)
+{
+	kb_led_set(&data->kb_led, i % 2 ? 30 : 60);
+	flush_work(&data->kb_work);
+}
+
+static void fw_bench_ec_get_kb_led(struct framework_data *data, int i)
+{
+	ec_get_kb_led(data, "kunit");
+}
+
+static void fw_bench_fan_input(struct framework_data *data, int i)
+{
+	long val;
+
+	fw_fan_read(data, hwmon_fan_input, 0, &val);
+}
+
+static void fw_bench_count_fans(struct framework_data *data, int i)
+{
+	size_t count;
+
+	ec_count_fans(data, &count);
+}
+
+static void fw_bench_snapshot(struct framework_data *data, int i)
+{
+	framework_update_snapshot(data, "kunit");
+}
+
+static const struct {
+	const char *name;
+	void (*fn)(struct framework_data *data, int i);
+} fw_benches[] = {
+	{ "charge_limit_control(GET_LIMIT)", fw_bench_charge_limit_get },
+	{ "charge_limit_control(SET_LIMIT)", fw_bench_charge_limit_set },
+	{ "kb_led_get", fw_bench_kb_led_get },
+	{ "kb_led_set+flush", fw_bench_kb_led_set },
+	{ "ec_get_kb_led", fw_bench_ec_get_kb_led },
+	{ "fw_fan_read(fan_input)", fw_bench_fan_input },
+	{ "ec_count_fans", fw_bench_count_fans },
+	{ "framework_update_snapshot", fw_bench_snapshot },
+};
+
+static void fw_test_bench(struct kunit *test)
+{
+	struct fw_test *t = test->priv;
+	struct framework_data *data = &t->data;
+
+	t->fake.cmd_latency_us = 100;
+	t->fake.readmem_latency_us = 5;
+	framework_update_snapshot(data, "kunit");
+
+	for (size_t b = 0; b < ARRAY_SIZE(fw_benches); b++) {
+		u64 calls = fw_test_ec_calls(data);
+		u64 start = ktime_get_ns();
+		u64 ns;
+
+		for (int i = 0; i < FW_BENCH_ITERATIONS; i++)
+			fw_benches[b].fn(data, i);
+
+		ns = ktime_get_ns() - start;
+		calls = (fw_test_ec_calls(data) - calls) * 100 / FW_BENCH_ITERATIONS;
+		kunit_info(test, "%s: %llu ns/op, %llu.%02llu EC transactions/op\n",
+			   fw_benches[b].name, div64_u64(ns, FW_BENCH_ITERATIONS),
+			   calls / 100, calls % 100);
+	}
+}
+
+static struct kunit_case framework_laptop_test_cases[] = {
+	KUNIT_CASE(fw_test_caps),
+	KUNIT_CASE(fw_test_charge_limit),
+	KUNIT_CASE(fw_test_charge_limit_error),
+	KUNIT_CASE(fw_test_kb_led),
+	KUNIT_CASE(fw_test_kb_led_coalesce),
+	KUNIT_CASE(fw_test_kb_led_error),
+	KUNIT_CASE(fw_test_count_fans),
+	KUNIT_CASE(fw_test_fan_read),
+	KUNIT_CASE(fw_test_fan_coalesce),
+	KUNIT_CASE(fw_test_fan_request_error),
+	KUNIT_CASE(fw_test_ec_event),
+	KUNIT_CASE(fw_test_resume),
+	KUNIT_CASE(fw_test_resume_restore),
+	KUNIT_CASE(fw_test_concurrent_charge_limit),
+	KUNIT_CASE(fw_test_concurrent_charge_limit_set),
+	KUNIT_CASE(fw_test_concurrent_snapshot),
+	KUNIT_CASE(fw_test_bench),
+	{}
+};
+
+static struct kunit_suite framework_laptop_test_suite = {
+	.name = DRV_NAME,
+	.init = fw_test_init,
+	.exit = fw_test_exit,
+	.test_cases = framework_laptop_test_cases,
+};
+kunit_test_suite(framework_laptop_test_suite);
+
+MODULE_DESCRIPTION("KUnit tests for the Framework Laptop Platform Driver");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,124 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * Framework Laptop ACPI Driver tracepoints
+ *
+ * Copyright (C) 2022 Dustin L. Howett
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM framework_laptop
+
+#if !defined(_FRAMEWORK_LAPTOP_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _FRAMEWORK_LAPTOP_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/types.h>
+#include <linux/version.h>
+
+// origin is the attribute or work the access was made for, such as "pwm1"
+// or "poll", and caller the driver function that made it. Writes that go
+// through write-behind work are sent from a kworker, so the task in the
+// common fields only names the process for synchronous reads; origin still
+// names the attribute that was written.
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+#define fw_assign_origin() __assign_str(origin)
+#else
+#define fw_assign_origin() __assign_str(origin, origin)
+#endif
+TRACE_EVENT(ec_cmd_start,
+	TP_PROTO(u32 command, u32 version, size_t outsize, size_t insize,
+		 const char *origin, unsigned long caller),
+
+	TP_ARGS(command, version, outsize, insize, origin, caller),
+
+	TP_STRUCT__entry(
+		__field(u32, command)
+		__field(u32, version)
+		__field(size_t, outsize)
+		__field(size_t, insize)
+		__string(origin, origin)
+		__field(unsigned long, caller)
+	),
+
+	TP_fast_assign(
+		__entry->command = command;
+		__entry->version = version;
+		__entry->outsize = outsize;
+		__entry->insize = insize;
+		fw_assign_origin();
+		__entry->caller = caller;
+	),
+
+	TP_printk("command=0x%04x version=%u outsize=%zu insize=%zu origin=%s caller=%pS",
+		  __entry->command, __entry->version, __entry->outsize,
+		  __entry->insize, __get_str(origin), (void *)__entry->caller)
+);
+
+TRACE_EVENT(ec_cmd_end,
+	TP_PROTO(u32 command, u32 version, int result, u64 duration_ns,
+		 const char *origin, unsigned long caller),
+
+	TP_ARGS(command, version, result, duration_ns, origin, caller),
+
+	TP_STRUCT__entry(
+		__field(u32, command)
+		__field(u32, version)
+		__field(int, result)
+		__field(u64, duration_ns)
+		__string(origin, origin)
+		__field(unsigned long, caller)
+	),
+
+	TP_fast_assign(
+		__entry->command = command;
+		__entry->version = version;
+		__entry->result = result;
+		__entry->duration_ns = duration_ns;
+		fw_assign_origin();
+		__entry->caller = caller;
+	),
+
+	TP_printk("command=0x%04x version=%u result=%d duration_ns=%llu origin=%s caller=%pS",
+		  __entry->command, __entry->version, __entry->result,
+		  __entry->duration_ns, __get_str(origin),
+		  (void *)__entry->caller)
+);
+
+TRACE_EVENT(ec_readmem,
+	TP_PROTO(u32 offset, u32 bytes, int result, u64 duration_ns,
+		 const char *origin, unsigned long caller),
+
+	TP_ARGS(offset, bytes, result, duration_ns, origin, caller),
+
+	TP_STRUCT__entry(
+		__field(u32, offset)
+		__field(u32, bytes)
+		__field(int, result)
+		__field(u64, duration_ns)
+		__string(origin, origin)
+		__field(unsigned long, caller)
+	),
+
+	TP_fast_assign(
+		__entry->offset = offset;
+		__entry->bytes = bytes;
+		__entry->result = result;
+		__entry->duration_ns = duration_ns;
+		fw_assign_origin();
+		__entry->caller = caller;
+	),
+
+	TP_printk("offset=0x%02x bytes=%u result=%d duration_ns=%llu origin=%s caller=%pS",
+		  __entry->offset, __entry->bytes, __entry->result,
+		  __entry->duration_ns, __get_str(origin),
+		  (void *)__entry->caller)
+);
+
+#endif /* _FRAMEWORK_LAPTOP_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE framework_laptop_trace
+
+#include <trace/define_trace.h>
@@ -0,0 +1,484 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Load generator and latency benchmark for the framework_laptop driver
+ *
+ * Runs concurrent readers of fan*_input, framework_privacy and
+ * charge_control_end_threshold, and writers to pwm* and the keyboard
+ * backlight, then reports read and write latency percentiles and the EC
+ * traffic they caused, taken from the ec_stats debugfs file.
+ *
+ * Results are printed as TAP, like the kselftests: one test each for the
+ * reads, the writes and the EC traffic, with the numbers as diagnostics.
+ * A test fails if any of its operations failed, and is skipped if it had
+ * nothing to measure.
+ *
+ * Build with "make bench" and run as root (debugfs and the writable
+ * attributes need it).
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_PATHS 16
+#define PATH_LEN 384
+
+#define PLATFORM_DIR "/sys/devices/platform/framework_laptop"
+#define BATTERY_LIMIT "/sys/class/power_supply/BAT1/charge_control_end_threshold"
+#define KBD_BRIGHTNESS "/sys/class/leds/framework_laptop::kbd_backlight/brightness"
+#define DEBUGFS_DIR "/sys/kernel/debug/framework_laptop"
+
+struct path_set {
+	int count;
+	char paths[MAX_PATHS][PATH_LEN];
+};
+
+// Latencies of one thread, in ns
+struct samples {
+	uint64_t *ns;
+	size_t count;
+	size_t size;
+	uint64_t errors;
+};
+
+struct worker {
+	pthread_t thread;
+	int id;
+	struct samples samples;
+};
+
+// EC traffic totals from ec_stats
+struct ec_totals {
+	bool valid;
+	uint64_t cmds;
+	uint64_t readmems;
+	uint64_t errors;
+};
+
+static struct path_set read_paths;
+static struct path_set pwm_paths;
+static char kbd_path[PATH_LEN];
+static char debugfs_dir[PATH_LEN] = DEBUGFS_DIR;
+static unsigned int write_interval_us = 10000;
+static atomic_bool stop;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void samples_add(struct samples *s, uint64_t ns)
+{
+	if (s->count == s->size) {
+		size_t size = s->size ? s->size * 2 : 4096;
+		uint64_t *ns_new = realloc(s->ns, size * sizeof(*ns_new));
+
+		if (!ns_new) {
+			s->errors++;
+			return;
+		}
+		s->ns = ns_new;
+		s->size = size;
+	}
+	s->ns[s->count++] = ns;
+}
+
+static void samples_merge(struct samples *dst, const struct samples *src)
+{
+	for (size_t i = 0; i < src->count; i++)
+		samples_add(dst, src->ns[i]);
+	dst->errors += src->errors;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const struct samples *s, double p)
+{
+	size_t idx;
+
+	if (!s->count)
+		return 0;
+
+	idx = (size_t)(p * (s->count - 1) + 0.5);
+	return s->ns[idx];
+}
+
+static void path_add(struct path_set *set, const char *path)
+{
+	if (set->count >= MAX_PATHS || access(path, F_OK))
+		return;
+
+	snprintf(set->paths[set->count++], PATH_LEN, "%s", path);
+}
+
+// Find the hwmon directory whose name is framework_laptop
+static bool find_hwmon(char *dir, size_t len)
+{
+	char path[PATH_LEN], name[64];
+	struct dirent *ent;
+	bool found = false;
+	DIR *d;
+	FILE *f;
+
+	d = opendir("/sys/class/hwmon");
+	if (!d)
+		return false;
+
+	while (!found && (ent = readdir(d))) {
+		if (ent->d_name[0] == '.')
+			continue;
+
+		snprintf(path, sizeof(path), "/sys/class/hwmon/%s/name",
+			 ent->d_name);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		if (fgets(name, sizeof(name), f) &&
+		    !strcmp(name, "framework_laptop\n")) {
+			snprintf(dir, len, "/sys/class/hwmon/%s", ent->d_name);
+			found = true;
+		}
+		fclose(f);
+	}
+	closedir(d);
+
+	return found;
+}
+
+static void find_paths(void)
+{
+	char hwmon[PATH_LEN - 32], path[PATH_LEN];
+
+	if (find_hwmon(hwmon, sizeof(hwmon))) {
+		for (int i = 1; i <= 4; i++) {
+			snprintf(path, sizeof(path), "%s/fan%d_input", hwmon, i);
+			path_add(&read_paths, path);
+			snprintf(path, sizeof(path), "%s/pwm%d", hwmon, i);
+			path_add(&pwm_paths, path);
+		}
+	}
+	path_add(&read_paths, PLATFORM_DIR "/framework_privacy");
+	path_add(&read_paths, BATTERY_LIMIT);
+
+	if (!access(KBD_BRIGHTNESS, F_OK))
+		snprintf(kbd_path, sizeof(kbd_path), "%s", KBD_BRIGHTNESS);
+}
+
+static int read_file(const char *path, char *buf, size_t len)
+{
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	n = read(fd, buf, len - 1);
+	close(fd);
+	if (n < 0)
+		return -errno;
+
+	buf[n] = '\0';
+	return 0;
+}
+
+static int write_file(const char *path, const char *val)
+{
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -errno;
+	n = write(fd, val, strlen(val));
+	close(fd);
+
+	return n < 0 ? -errno : 0;
+}
+
+static void *reader_main(void *arg)
+{
+	struct worker *w = arg;
+	char buf[256];
+	int fds[MAX_PATHS];
+	uint64_t start;
+	unsigned int i = w->id;
+
+	// Keep the files open and re-read from offset 0, which makes sysfs
+	// call the show function again, so open() isn't part of the latency
+	for (int p = 0; p < read_paths.count; p++)
+		fds[p] = open(read_paths.paths[p], O_RDONLY);
+
+	while (!atomic_load(&stop)) {
+		int p = i++ % read_paths.count;
+
+		if (fds[p] < 0)
+			continue;
+
+		start = now_ns();
+		if (pread(fds[p], buf, sizeof(buf), 0) < 0)
+			w->samples.errors++;
+		else
+			samples_add(&w->samples, now_ns() - start);
+	}
+
+	for (int p = 0; p < read_paths.count; p++) {
+		if (fds[p] >= 0)
+			close(fds[p]);
+	}
+
+	return NULL;
+}
+
+static void *writer_main(void *arg)
+{
+	struct worker *w = arg;
+	unsigned int targets = pwm_paths.count + (kbd_path[0] ? 1 : 0);
+	unsigned int i = w->id;
+	char val[16];
+	uint64_t start;
+	int ret;
+
+	while (!atomic_load(&stop)) {
+		unsigned int t = i % targets;
+		const char *path = t < (unsigned int)pwm_paths.count ?
+				   pwm_paths.paths[t] : kbd_path;
+
+		// Move between 30 and 60 percent so writes aren't dropped
+		// as duplicates
+		snprintf(val, sizeof(val), "%u", 30 + (i * 7) % 31);
+		i++;
+
+		start = now_ns();
+		ret = write_file(path, val);
+		if (ret < 0)
+			w->samples.errors++;
+		else
+			samples_add(&w->samples, now_ns() - start);
+
+		if (write_interval_us)
+			usleep(write_interval_us);
+	}
+
+	return NULL;
+}
+
+static struct ec_totals read_ec_stats(void)
+{
+	struct ec_totals t = { 0 };
+	char path[PATH_LEN + 16], line[512], kind[16];
+	unsigned long long calls, errors;
+	unsigned int id;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/ec_stats", debugfs_dir);
+	f = fopen(path, "r");
+	if (!f)
+		return t;
+
+	t.valid = true;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%15s 0x%x calls=%llu errors=%llu", kind, &id,
+			   &calls, &errors) != 4)
+			continue;
+
+		if (!strcmp(kind, "readmem"))
+			t.readmems += calls;
+		else
+			t.cmds += calls;
+		t.errors += errors;
+	}
+	fclose(f);
+
+	return t;
+}
+
+static unsigned int tap_test;
+static bool tap_failed;
+
+static void tap_result(bool ok, const char *name, const char *skip)
+{
+	tap_test++;
+	if (!ok)
+		tap_failed = true;
+
+	printf("%s %u %s", ok ? "ok" : "not ok", tap_test, name);
+	if (skip)
+		printf(" # SKIP %s", skip);
+	printf("\n");
+}
+
+static void report(const char *what, struct samples *s, unsigned int threads,
+		   double secs)
+{
+	if (!threads) {
+		tap_result(true, what, "no attributes to use");
+		return;
+	}
+
+	qsort(s->ns, s->count, sizeof(*s->ns), cmp_u64);
+
+	printf("# %s ops=%zu errors=%" PRIu64 " ops/s=%.0f", what, s->count,
+	       s->errors, s->count / secs);
+	if (s->count)
+		printf(" p50_us=%.1f p99_us=%.1f p999_us=%.1f max_us=%.1f",
+		       percentile(s, 0.50) / 1000.0, percentile(s, 0.99) / 1000.0,
+		       percentile(s, 0.999) / 1000.0,
+		       s->ns[s->count - 1] / 1000.0);
+	printf("\n");
+
+	tap_result(s->count && !s->errors, what, NULL);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-t seconds] [-r readers] [-w writers] [-i write_interval_us] [-d debugfs_dir]\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int seconds = 10, nr_readers = 4, nr_writers = 1;
+	struct samples reads = { 0 }, writes = { 0 };
+	char saved_enable[MAX_PATHS][16], saved_pwm[MAX_PATHS][16];
+	char saved_kbd[16] = "";
+	struct ec_totals before, after;
+	struct worker *workers;
+	uint64_t start, elapsed;
+	double secs;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:r:w:i:d:h")) != -1) {
+		switch (opt) {
+		case 't':
+			seconds = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			nr_readers = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			nr_writers = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			write_interval_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			snprintf(debugfs_dir, sizeof(debugfs_dir), "%s", optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	find_paths();
+	if (!read_paths.count)
+		nr_readers = 0;
+	if (!pwm_paths.count && !kbd_path[0])
+		nr_writers = 0;
+	if (!nr_readers && !nr_writers) {
+		printf("TAP version 13\n1..0 # SKIP no framework_laptop attributes found\n");
+		return 4;
+	}
+
+	// Remember what the writers are about to change. The duty has to be
+	// put back too, or an enable of 1 would resume the benchmark's duty.
+	// It can't be read if no duty was ever set, so leave it alone then.
+	for (int i = 0; i < pwm_paths.count; i++) {
+		char path[PATH_LEN + 16];
+
+		snprintf(path, sizeof(path), "%s_enable", pwm_paths.paths[i]);
+		if (read_file(path, saved_enable[i], sizeof(saved_enable[i])))
+			snprintf(saved_enable[i], sizeof(saved_enable[i]), "2");
+		if (read_file(pwm_paths.paths[i], saved_pwm[i], sizeof(saved_pwm[i])))
+			saved_pwm[i][0] = '\0';
+	}
+	if (kbd_path[0])
+		read_file(kbd_path, saved_kbd, sizeof(saved_kbd));
+
+	workers = calloc(nr_readers + nr_writers, sizeof(*workers));
+	if (!workers)
+		return 1;
+
+	printf("TAP version 13\n1..3\n");
+
+	before = read_ec_stats();
+
+	start = now_ns();
+	for (unsigned int i = 0; i < nr_readers + nr_writers; i++) {
+		workers[i].id = i;
+		pthread_create(&workers[i].thread, NULL,
+			       i < nr_readers ? reader_main : writer_main,
+			       &workers[i]);
+	}
+
+	sleep(seconds);
+	atomic_store(&stop, true);
+
+	for (unsigned int i = 0; i < nr_readers + nr_writers; i++) {
+		pthread_join(workers[i].thread, NULL);
+		samples_merge(i < nr_readers ? &reads : &writes,
+			      &workers[i].samples);
+		free(workers[i].samples.ns);
+	}
+	elapsed = now_ns() - start;
+	after = read_ec_stats();
+
+	// Duty first, since writing it selects manual mode, then the mode
+	for (int i = 0; i < pwm_paths.count; i++) {
+		char path[PATH_LEN + 16];
+
+		if (saved_pwm[i][0])
+			write_file(pwm_paths.paths[i], saved_pwm[i]);
+		snprintf(path, sizeof(path), "%s_enable", pwm_paths.paths[i]);
+		write_file(path, saved_enable[i]);
+	}
+	if (saved_kbd[0])
+		write_file(kbd_path, saved_kbd);
+
+	secs = elapsed / 1e9;
+	printf("# duration_s=%.2f readers=%u writers=%u\n", secs, nr_readers,
+	       nr_writers);
+	report("read", &reads, nr_readers, secs);
+	report("write", &writes, nr_writers, secs);
+
+	if (before.valid && after.valid) {
+		uint64_t cmds = after.cmds - before.cmds;
+		uint64_t readmems = after.readmems - before.readmems;
+		uint64_t errors = after.errors - before.errors;
+		uint64_t ops = reads.count + writes.count;
+
+		printf("# ec cmds=%" PRIu64 " readmems=%" PRIu64 " errors=%" PRIu64
+		       " cmds/s=%.1f readmems/s=%.1f cmds/op=%.4f\n",
+		       cmds, readmems, errors, cmds / secs, readmems / secs,
+		       ops ? (double)cmds / ops : 0.0);
+		tap_result(!errors, "ec", NULL);
+	} else {
+		tap_result(true, "ec", "ec_stats not readable");
+	}
+
+	free(reads.ns);
+	free(writes.ns);
+	free(workers);
+	return tap_failed;
+}